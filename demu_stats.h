@@ -0,0 +1,236 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2016 Intel Corporation. All rights reserved.
+ *   Copyright(c) 2016-2021 National Institute of Advanced Industrial
+ *                Science and Technology. All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* vim: set noexpandtab ai: */
+
+#ifndef _DEMU_STATS_H_
+#define _DEMU_STATS_H_
+
+/*
+ * Statistics shared between DEMU (the primary process) and demu-stat
+ * (a secondary process). DEMU places struct demu_stats in the memzone
+ * DEMU_STATS_MZ, and the rings and mempools of the pipeline are looked up
+ * by their names.
+ */
+#define DEMU_STATS_MZ "demu_stats"
+
+#define DEMU_MBUF_POOL "mbuf_pool"
+#define DEMU_CLONE_POOL "clone_pool"
+#define DEMU_XT_POOL "xt_pool"
+#define DEMU_RING_RX_TO_WORKERS "rx_to_workers"
+#define DEMU_RING_RX_TO_WORKERS2 "rx_to_workers2"
+#define DEMU_RING_WORKERS_TO_TX "workers_to_tx"
+#define DEMU_RING_WORKERS_TO_TX2 "workers_to_tx2"
+
+/*
+ * Per-port statistics struct.
+ * The RX and worker counters belong to the ingress port, and the TX
+ * counters to the egress port. Each group is written by one thread and
+ * sits in its own cache line.
+ */
+struct demu_port_statistics {
+	/* RX thread */
+	uint64_t rx;
+	uint64_t rx_worker_dropped;
+	uint64_t discarded;
+	uint64_t duplicated;
+	uint64_t dup_dropped;
+	uint64_t fastpath;
+	uint64_t fastpath_dropped;
+	uint64_t xt_generated;
+	uint64_t xt_dropped;
+
+	/* worker thread */
+	uint64_t worker_tx_dropped __rte_cache_aligned;
+	uint64_t queue_dropped;
+	uint64_t hop_lost;
+	uint64_t link_lost;
+
+	/* TX thread */
+	uint64_t tx __rte_cache_aligned;
+	uint64_t dropped;
+} __rte_cache_aligned;
+
+/*
+ * Residence time histogram (--latency-probe).
+ * The TX stage of each egress port records the time from the RX stamp to
+ * the hand-off to the NIC, in TSC cycles, into a log-linear histogram:
+ * values below 2 * DEMU_HIST_SUB have their own bucket, and each power of
+ * two above is split into DEMU_HIST_SUB buckets, so that the relative
+ * error of a bucket is below 1 / DEMU_HIST_SUB. Only the TX lcore of the
+ * port writes the histogram, and readers may see it in the middle of an
+ * update.
+ */
+#define DEMU_HIST_SUB_BITS 8
+#define DEMU_HIST_SUB (1U << DEMU_HIST_SUB_BITS)
+#define DEMU_HIST_MAX_BITS 40 /* about 6 minutes at 3 GHz */
+#define DEMU_HIST_NB_BUCKETS ((DEMU_HIST_MAX_BITS - DEMU_HIST_SUB_BITS + 1) * DEMU_HIST_SUB)
+#define DEMU_LATENCY_PORTS 2
+
+struct demu_latency_hist {
+	uint64_t target_us; /* configured delay of the direction */
+	uint64_t count;
+	uint64_t max;
+	uint64_t bucket[DEMU_HIST_NB_BUCKETS];
+} __rte_cache_aligned;
+
+static inline unsigned
+demu_hist_index(uint64_t v)
+{
+	unsigned e;
+
+	if (v < 2 * DEMU_HIST_SUB)
+		return v;
+	if (v >> DEMU_HIST_MAX_BITS)
+		return DEMU_HIST_NB_BUCKETS - 1;
+
+	e = 63 - __builtin_clzll(v) - DEMU_HIST_SUB_BITS;
+	return (e + 1) * DEMU_HIST_SUB + ((v >> e) & (DEMU_HIST_SUB - 1));
+}
+
+/* The middle of a bucket */
+static inline uint64_t
+demu_hist_value(unsigned idx)
+{
+	unsigned e;
+
+	if (idx < 2 * DEMU_HIST_SUB)
+		return idx;
+
+	e = idx / DEMU_HIST_SUB - 1;
+	return ((uint64_t)(DEMU_HIST_SUB + idx % DEMU_HIST_SUB) << e) + (1ULL << e) / 2;
+}
+
+static inline void
+demu_hist_record(struct demu_latency_hist *h, uint64_t v)
+{
+	h->bucket[demu_hist_index(v)]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Value at the quantile q (0 < q <= 1), or 0 if nothing is recorded */
+static inline uint64_t
+demu_hist_quantile(const struct demu_latency_hist *h, double q)
+{
+	uint64_t total = 0, rank, sum = 0;
+	unsigned i;
+
+	for (i = 0; i < DEMU_HIST_NB_BUCKETS; i++)
+		total += h->bucket[i];
+	if (total == 0)
+		return 0;
+
+	rank = (uint64_t)(q * total + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < DEMU_HIST_NB_BUCKETS; i++) {
+		sum += h->bucket[i];
+		if (sum >= rank)
+			return RTE_MIN(demu_hist_value(i), h->max);
+	}
+
+	return h->max;
+}
+
+/*
+ * Per-stage cycle accounting (built with -DDEMU_PROFILE, e.g., make PROFILE=1).
+ * Every lcore adds the TSC cycles spent in each call of a pipeline stage,
+ * the packets handled, and the calls which handled none (empty polls) to
+ * its own struct demu_lcore_profile. The RX stage includes the impairment
+ * (loss, duplication and the enqueue to the worker) done by the RX thread,
+ * which is also counted separately. The consumer of each ring samples its
+ * occupancy every DEMU_RING_SAMPLE_US.
+ */
+enum demu_stage {
+	DEMU_STAGE_RX,
+	DEMU_STAGE_IMPAIR,
+	DEMU_STAGE_WORKER,
+	DEMU_STAGE_TX,
+	DEMU_NB_STAGES,
+};
+
+/* in the order of the pipeline of each direction */
+enum demu_ring_index {
+	DEMU_RING_IDX_RX_TO_WORKERS,
+	DEMU_RING_IDX_WORKERS_TO_TX2,
+	DEMU_RING_IDX_RX_TO_WORKERS2,
+	DEMU_RING_IDX_WORKERS_TO_TX,
+	DEMU_NB_RINGS,
+};
+
+#define DEMU_RING_SAMPLE_US 100
+
+static inline const char *
+demu_stage_name(enum demu_stage stage)
+{
+	static const char * const names[DEMU_NB_STAGES] = {
+		"rx", "impair", "worker", "tx",
+	};
+
+	return names[stage];
+}
+
+struct demu_stage_profile {
+	uint64_t calls;
+	uint64_t empty;
+	uint64_t pkts;
+	uint64_t cycles;
+};
+
+struct demu_lcore_profile {
+	struct demu_stage_profile stage[DEMU_NB_STAGES];
+} __rte_cache_aligned;
+
+struct demu_ring_profile {
+	uint64_t next_sample;
+	uint64_t samples;
+	uint64_t sum;
+	uint32_t last;
+	uint32_t max;
+} __rte_cache_aligned;
+
+struct demu_stats {
+	uint64_t tsc_hz;
+	uint64_t start_tsc;
+	uint32_t nb_ports;
+	uint32_t probe_interval; /* 0 if the latency probe is disabled */
+	uint32_t profile;        /* 1 if built with DEMU_PROFILE */
+	struct demu_port_statistics port[RTE_MAX_ETHPORTS];
+	struct demu_latency_hist latency[DEMU_LATENCY_PORTS];
+	struct demu_lcore_profile lcore[RTE_MAX_LCORE];
+	struct demu_ring_profile ring[DEMU_NB_RINGS];
+};
+
+#endif /* _DEMU_STATS_H_ */
@@ -49,6 +49,9 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 /*
  * RTE_LIBRTE_RING_DEBUG generates statistics of ring buffers. However, SEGV is occurred. (v16.07）
@@ -80,6 +83,41 @@
 #include <rte_mbuf.h>
 #include <rte_errno.h>
 #include <rte_timer.h>
+#include <rte_hash_crc.h>
+#include <rte_flow.h>
+
+#include <rte_version.h>
+
+#include "demu_stats.h"
+
+/*
+ * Dynamic mbuf fields, rte_mbuf_timestamp_t and the timestamp dynfields
+ * came with DPDK 20.11, and DPDK_VERSION only holds the major number.
+ */
+#if RTE_VERSION >= RTE_VERSION_NUM(20, 11, 0, 0)
+#define DEMU_MBUF_DYN 1
+#include <rte_mbuf_dyn.h>
+#else
+#define DEMU_MBUF_DYN 0
+#endif
+#if DPDK_VERSION >= 21
+#include <rte_cpuflags.h>
+#include <rte_power_intrinsics.h>
+#endif
+
+/* ethdev names were prefixed with RTE_ETH_ in DPDK 21.11 */
+#ifndef RTE_ETH_MQ_TX_NONE
+#define RTE_ETH_MQ_TX_NONE ETH_MQ_TX_NONE
+#endif
+#ifndef RTE_ETH_RX_OFFLOAD_TIMESTAMP
+#define RTE_ETH_RX_OFFLOAD_TIMESTAMP DEV_RX_OFFLOAD_TIMESTAMP
+#endif
+#ifndef RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP
+#define RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP DEV_TX_OFFLOAD_SEND_ON_TIMESTAMP
+#endif
+#ifndef RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE
+#define RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE DEV_TX_OFFLOAD_MBUF_FAST_FREE
+#endif
 
 static int64_t loss_random(const char *loss_rate);
 static int64_t loss_random_a(double loss_rate);
@@ -87,21 +125,44 @@ static bool loss_event(void);
 static bool loss_event_random(uint64_t loss_rate);
 static bool loss_event_GE(uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no2ab, uint64_t st_ch_rate_ab2no);
 static bool loss_event_4state( uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint64_t p32);
-static bool dup_event(void);
+static unsigned dup_event(void);
 static uint64_t normal_distribution(uint64_t mean, uint64_t stddev);
 #define RANDOM_MAX 1000000000
 
 static volatile bool force_quit;
 
+/*
+ * Offline mode (--pcap-in/--pcap-out).
+ * The datapath reads the time with demu_now(), which returns the virtual
+ * clock driven by the packet timestamps in the offline mode.
+ */
+static bool offline = false;
+static uint64_t virtual_tsc;
+
+static inline uint64_t
+demu_now(void)
+{
+	if (unlikely(offline))
+		return virtual_tsc;
+	return rte_rdtsc();
+}
+
 #define RTE_LOGTYPE_DEMU RTE_LOGTYPE_USER1
 
 /*
- * Configurable number of RX/TX ring descriptors
+ * Configurable number of RX/TX ring descriptors and burst sizes of each
+ * port (--port-config). The PMD may round the numbers of descriptors.
  */
 #define RTE_TEST_RX_DESC_DEFAULT 128
 #define RTE_TEST_TX_DESC_DEFAULT 512
-static uint16_t nb_rxd = RTE_TEST_RX_DESC_DEFAULT;
-static uint16_t nb_txd = RTE_TEST_TX_DESC_DEFAULT;
+
+struct demu_port_params {
+	uint16_t nb_rxd;
+	uint16_t nb_txd;
+	uint16_t rx_burst;
+	uint16_t tx_burst;
+};
+static struct demu_port_params port_params[RTE_MAX_ETHPORTS];
 
 /* ethernet addresses of ports */
 #if DPDK_VERSION > 18
@@ -113,17 +174,171 @@ struct rte_mempool * demu_pktmbuf_pool = NULL;
 
 static uint32_t demu_enabled_port_mask = 0;
 
-/* Per-port statistics struct */
-struct demu_port_statistics {
-	uint64_t tx;
-	uint64_t rx;
-	uint64_t dropped;
-	uint64_t rx_worker_dropped;
-	uint64_t worker_tx_dropped;
-	uint64_t queue_dropped;
-	uint64_t discarded;
+/* Statistics in the memzone DEMU_STATS_MZ, which demu-stat reads */
+static struct demu_stats *demu_stats;
+static struct demu_port_statistics *port_statistics;
+
+/*
+ * Random numbers for the impairment decisions (--seed).
+ * Each lcore has its own xoshiro256** generator, seeded from the global
+ * seed and the lcore ID by splitmix64, so that a run with the same seed,
+ * cores and input makes the same decisions. Without --seed, the seed is
+ * taken from the TSC and printed.
+ * With --decision-log, each lcore records its first DECISION_LOG_ENTRIES
+ * decisions, which are written to the file on exit.
+ */
+#define DECISION_LOG_ENTRIES (1 << 18)
+
+enum demu_decision_kind {
+	DECISION_LOSS,
+	DECISION_DUP,
+	DECISION_JITTER,
+	DECISION_HOP_LOSS,
+	DECISION_LINK_LOSS,
+};
+
+static const char * const decision_names[] = {
+	[DECISION_LOSS] = "loss",
+	[DECISION_DUP] = "dup",
+	[DECISION_JITTER] = "jitter",
+	[DECISION_HOP_LOSS] = "hop-loss",
+	[DECISION_LINK_LOSS] = "link-loss",
+};
+
+struct demu_decision {
+	uint64_t tsc;
+	uint64_t seq;   /* packet number on the ingress port, if any */
+	uint32_t kind;
+	uint32_t value;
+};
+
+struct demu_rng {
+	uint64_t s[4];
+	double spare;   /* second normal deviate of the polar method */
+	bool has_spare;
+	struct demu_decision *log;
+	unsigned log_len;
 } __rte_cache_aligned;
-struct demu_port_statistics port_statistics[RTE_MAX_ETHPORTS];
+
+static struct demu_rng demu_rngs[RTE_MAX_LCORE];
+static uint64_t demu_seed;
+static bool seed_given = false;
+static const char *decision_log_file = NULL;
+
+static inline uint64_t
+rotl(const uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+demu_rng_init(uint64_t seed)
+{
+	uint64_t x;
+	unsigned lcore_id, i;
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		x = seed ^ ((uint64_t)lcore_id << 32);
+		for (i = 0; i < 4; i++)
+			demu_rngs[lcore_id].s[i] = splitmix64(&x);
+		demu_rngs[lcore_id].has_spare = false;
+	}
+}
+
+static inline uint64_t
+demu_rand(void)
+{
+	uint64_t *s = demu_rngs[rte_lcore_id()].s;
+	const uint64_t result = rotl(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return result;
+}
+
+/* Uniform random number in (0, 1] */
+static inline double
+demu_rand_double(void)
+{
+	return ((demu_rand() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static inline void
+decision_record(enum demu_decision_kind kind, uint64_t seq, uint32_t value)
+{
+	struct demu_rng *r;
+
+	if (likely(decision_log_file == NULL))
+		return;
+
+	r = &demu_rngs[rte_lcore_id()];
+	if (r->log == NULL || r->log_len == DECISION_LOG_ENTRIES)
+		return;
+	r->log[r->log_len].tsc = demu_now();
+	r->log[r->log_len].seq = seq;
+	r->log[r->log_len].kind = kind;
+	r->log[r->log_len].value = value;
+	r->log_len++;
+}
+
+static int
+decision_log_alloc(void)
+{
+	unsigned lcore_id;
+
+	RTE_LCORE_FOREACH(lcore_id) {
+		demu_rngs[lcore_id].log = rte_malloc("decision_log",
+			sizeof(struct demu_decision) * DECISION_LOG_ENTRIES, 0);
+		if (demu_rngs[lcore_id].log == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* lcore, time since start [us], packet number, decision, value */
+static void
+decision_log_write(uint64_t start_tsc)
+{
+	const struct demu_rng *r;
+	double us_per_tsc = (double)US_PER_S / rte_get_tsc_hz();
+	unsigned lcore_id, i;
+	FILE *fp;
+
+	fp = fopen(decision_log_file, "w");
+	if (fp == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot open %s: %s\n", decision_log_file, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "# seed %" PRIu64 "\n", demu_seed);
+	RTE_LCORE_FOREACH(lcore_id) {
+		r = &demu_rngs[lcore_id];
+		for (i = 0; i < r->log_len; i++)
+			fprintf(fp, "%u %.3f %" PRIu64 " %s %u\n", lcore_id,
+				(int64_t)(r->log[i].tsc - start_tsc) * us_per_tsc,
+				r->log[i].seq, decision_names[r->log[i].kind], r->log[i].value);
+		if (r->log_len == DECISION_LOG_ENTRIES)
+			fprintf(fp, "# lcore %u: log is full\n", lcore_id);
+	}
+	fclose(fp);
+}
 
 /*
  * Assigment of each thread to a specific CPU core.
@@ -138,12 +353,15 @@ struct demu_port_statistics port_statistics[RTE_MAX_ETHPORTS];
 #define TIMER_THREAD_CORE 1
 
 /*
- * The maximum number of packets which are processed in burst.
- * Note: do not set PKT_BURST_RX to 1.
+ * The number of packets which are processed in burst.
+ * PKT_BURST_RX and PKT_BURST_TX are the defaults of the RX and TX bursts
+ * of each port, which can be changed up to MAX_PKT_BURST.
+ * Note: do not set the RX burst to 1.
  */
 #define PKT_BURST_RX 32
 #define PKT_BURST_TX 32
 #define PKT_BURST_WORKER 32
+#define MAX_PKT_BURST 128
 
 /*
  * The default mempool size is not enough for buffering 64KB of short packets for 1 second.
@@ -158,14 +376,97 @@ struct demu_port_statistics port_statistics[RTE_MAX_ETHPORTS];
 #define MEMPOOL_BUF_SIZE RTE_MBUF_DEFAULT_BUF_SIZE /* 2048 */
 #endif
 
+/*
+ * Populating the pool takes most of the startup time, and the default
+ * covers a long delay at the line rate. --buffer-pkts sizes the pool
+ * and the rings to the emulated scenario, e.g., to the packets arriving
+ * at the line rate during the delay.
+ */
+#define DEMU_MIN_BUFFER_PKTS 16384
+#define DEMU_MAX_BUFFER_PKTS (1 << 28)
+/* the offline mode has no line rate to cover, and runs without hugepages */
+#define DEMU_OFFLINE_BUFFER_PKTS 65536
+static uint32_t delayed_buffer_pkts = DEMU_DELAYED_BUFFER_PKTS;
+static bool buffer_pkts_set = false;
+
+/* Forwarding starts when the links are up or after --link-wait [ms] */
+#define CHECK_INTERVAL 100 /* 100ms */
+#define MAX_CHECK_TIME 9000 /* 9s in total */
+static unsigned link_wait_ms = MAX_CHECK_TIME;
+
 #define MEMPOOL_CACHE_SIZE 512
 #define DEMU_SEND_BUFFER_SIZE_PKTS 512
 
+/*
+ * Duplicated packets are indirect mbufs taken from a dedicated pool, so that
+ * a copy costs a small mbuf header and a refcnt increment of the original.
+ * When the pool runs out, the remaining copies are counted as dup_dropped.
+ */
+#define DEMU_MAX_DUP_COPIES 8
+#define DEMU_CLONE_POOL_PKTS 65536
+
 struct rte_ring *rx_to_workers;
 struct rte_ring *rx_to_workers2;
 struct rte_ring *workers_to_tx;
 struct rte_ring *workers_to_tx2;
 
+/*
+ * Per-stage cycle accounting (see demu_stats.h). Without DEMU_PROFILE,
+ * the macros expand to the bare calls, and the datapath has no trace of it.
+ */
+#ifdef DEMU_PROFILE
+static uint64_t ring_sample_interval;
+
+static inline void
+profile_ring(enum demu_ring_index idx, const struct rte_ring *r, uint64_t now)
+{
+	struct demu_ring_profile *p = &demu_stats->ring[idx];
+	uint32_t count;
+
+	if (now < p->next_sample)
+		return;
+	p->next_sample = now + ring_sample_interval;
+
+	count = rte_ring_count(r);
+	p->samples++;
+	p->sum += count;
+	p->last = count;
+	if (count > p->max)
+		p->max = count;
+}
+
+/* Account a call of a stage, and sample the ring which the stage consumes */
+static inline unsigned
+profile_stage(enum demu_stage stage, unsigned portid, uint64_t begin, unsigned n)
+{
+	struct demu_stage_profile *p = &demu_stats->lcore[rte_lcore_id()].stage[stage];
+	uint64_t now = rte_rdtsc();
+
+	p->calls++;
+	p->pkts += n;
+	p->empty += (n == 0);
+	p->cycles += now - begin;
+
+	if (stage == DEMU_STAGE_WORKER)
+		profile_ring(portid == 0 ? DEMU_RING_IDX_RX_TO_WORKERS : DEMU_RING_IDX_RX_TO_WORKERS2,
+			portid == 0 ? rx_to_workers : rx_to_workers2, now);
+	else if (stage == DEMU_STAGE_TX)
+		profile_ring(portid == 1 ? DEMU_RING_IDX_WORKERS_TO_TX2 : DEMU_RING_IDX_WORKERS_TO_TX,
+			portid == 1 ? workers_to_tx2 : workers_to_tx, now);
+
+	return n;
+}
+
+#define PROFILE_STAGE(stage, portid, call) \
+	({ uint64_t begin__ = rte_rdtsc(); profile_stage(stage, portid, begin__, (call)); })
+#define PROFILE_BEGIN(t) uint64_t t = rte_rdtsc()
+#define PROFILE_END(stage, t, n) profile_stage(stage, 0, t, n)
+#else
+#define PROFILE_STAGE(stage, portid, call) (call)
+#define PROFILE_BEGIN(t) do {} while (0)
+#define PROFILE_END(stage, t, n) do {} while (0)
+#endif
+
 static uint64_t delayed_time_in_us = 0; 
 static uint64_t delayed_jitter = 0; 
 static uint64_t delayed_time = 0;
@@ -185,9 +486,23 @@ static uint64_t loss_percent_2 = 0;
 
 static uint64_t dup_rate = 0;
 
+enum demu_dup_dist {
+	DUP_DIST_FIXED,     /* always dup_copies copies */
+	DUP_DIST_UNIFORM,   /* 1 to dup_copies copies with equal probability */
+	DUP_DIST_GEOMETRIC, /* each further copy occurs with probability dup_rate */
+};
+static enum demu_dup_dist dup_dist = DUP_DIST_FIXED;
+static unsigned dup_copies = 1;
+static uint64_t dup_delay_in_us = 0;
+static uint64_t dup_delay = 0;
+
+struct rte_mempool *demu_clone_pool = NULL;
+
 static const struct rte_eth_conf port_conf = {
 	.rxmode = {
+		#if DPDK_VERSION < 23
 		.split_hdr_size = 0,
+		#endif
 		#if DPDK_VERSION < 18
 		.header_split   = 0, /**< Header Split disabled */
 		.hw_ip_checksum = 0, /**< IP checksum offload disabled */
@@ -197,10 +512,14 @@ static const struct rte_eth_conf port_conf = {
 		#endif
 	},
 	.txmode = {
-		.mq_mode = ETH_MQ_TX_NONE,
+		.mq_mode = RTE_ETH_MQ_TX_NONE,
 	},
 };
 
+/*
+ * Queue thresholds for DPDK 17.x (tuned for ixgbe). Later versions use
+ * the defaults of each PMD, which select its vector path if possible.
+ */
 static struct rte_eth_rxconf rx_conf = {
 	.rx_thresh = {                    /**< RX ring threshold registers. */
 		.pthresh = 8,             /**< Ring prefetch threshold. */
@@ -246,6 +565,176 @@ uint64_t tx_cnt = 0;
 #endif
 
 
+/*
+ * Arrival time of a packet in TSC cycles.
+ * udata64 was removed in DPDK 20.11, so a dynamic mbuf field is used instead.
+ * The departure time given by the shaper in the pacing mode is kept in
+ * another field (the timestamp field on older versions).
+ */
+#if DEMU_MBUF_DYN
+static int demu_tsc_dynfield_offset = -1;
+static int demu_depart_dynfield_offset = -1;
+
+static inline uint64_t
+demu_get_tsc(struct rte_mbuf *m)
+{
+	return *RTE_MBUF_DYNFIELD(m, demu_tsc_dynfield_offset, uint64_t *);
+}
+
+static inline void
+demu_set_tsc(struct rte_mbuf *m, uint64_t tsc)
+{
+	*RTE_MBUF_DYNFIELD(m, demu_tsc_dynfield_offset, uint64_t *) = tsc;
+}
+
+static inline uint64_t
+demu_get_depart(struct rte_mbuf *m)
+{
+	return *RTE_MBUF_DYNFIELD(m, demu_depart_dynfield_offset, uint64_t *);
+}
+
+static inline void
+demu_set_depart(struct rte_mbuf *m, uint64_t tsc)
+{
+	*RTE_MBUF_DYNFIELD(m, demu_depart_dynfield_offset, uint64_t *) = tsc;
+}
+#else
+static inline uint64_t
+demu_get_tsc(struct rte_mbuf *m)
+{
+	return m->udata64;
+}
+
+static inline void
+demu_set_tsc(struct rte_mbuf *m, uint64_t tsc)
+{
+	m->udata64 = tsc;
+}
+
+static inline uint64_t
+demu_get_depart(struct rte_mbuf *m)
+{
+	return m->timestamp;
+}
+
+static inline void
+demu_set_depart(struct rte_mbuf *m, uint64_t tsc)
+{
+	m->timestamp = tsc;
+}
+#endif
+
+/*
+ * NIC hardware RX timestamps (--hw-timestamp).
+ * The NIC clock is mapped to the TSC by a linear conversion which is
+ * calibrated at startup and re-synchronized once a second by the RX thread
+ * of the port. Packets without a valid timestamp fall back to the TSC value
+ * taken right after rte_eth_rx_burst().
+ */
+static bool hw_timestamp = false;
+
+#if DEMU_MBUF_DYN
+#define HWTS_SYNC_INTERVAL_MS 1000
+#define HWTS_CALIBRATION_MS 100
+
+struct demu_hwts_clock {
+	bool enabled;
+	uint64_t nic_base;
+	uint64_t tsc_base;
+	double tsc_per_tick;
+	uint64_t next_sync;
+} __rte_cache_aligned;
+static struct demu_hwts_clock hwts_clock[RTE_MAX_ETHPORTS];
+
+static int hwts_dynfield_offset = -1;
+static uint64_t hwts_dynflag_rx = 0;
+
+static void
+hwts_sync(unsigned portid, struct demu_hwts_clock *clk)
+{
+	uint64_t nic, tsc;
+
+	if (rte_eth_read_clock(portid, &nic) != 0)
+		return;
+	tsc = rte_rdtsc();
+
+	/* refine the frequency ratio with the drift since the last sync */
+	if (nic > clk->nic_base)
+		clk->tsc_per_tick = (double)(tsc - clk->tsc_base) / (nic - clk->nic_base);
+	clk->nic_base = nic;
+	clk->tsc_base = tsc;
+	clk->next_sync = tsc + rte_get_tsc_hz() / MS_PER_S * HWTS_SYNC_INTERVAL_MS;
+}
+
+static bool
+hwts_calibrate(unsigned portid, struct demu_hwts_clock *clk)
+{
+	uint64_t nic0, nic1, tsc0, tsc1;
+
+	if (rte_eth_read_clock(portid, &nic0) != 0)
+		return false;
+	tsc0 = rte_rdtsc();
+	rte_delay_ms(HWTS_CALIBRATION_MS);
+	if (rte_eth_read_clock(portid, &nic1) != 0)
+		return false;
+	tsc1 = rte_rdtsc();
+
+	if (nic1 <= nic0)
+		return false;
+
+	clk->tsc_per_tick = (double)(tsc1 - tsc0) / (nic1 - nic0);
+	clk->nic_base = nic1;
+	clk->tsc_base = tsc1;
+	clk->next_sync = tsc1 + rte_get_tsc_hz() / MS_PER_S * HWTS_SYNC_INTERVAL_MS;
+
+	return true;
+}
+
+static inline uint64_t
+hwts_to_tsc(const struct demu_hwts_clock *clk, struct rte_mbuf *m, uint64_t now)
+{
+	uint64_t ts, tsc;
+
+	if (!(m->ol_flags & hwts_dynflag_rx))
+		return now;
+
+	ts = *RTE_MBUF_DYNFIELD(m, hwts_dynfield_offset, rte_mbuf_timestamp_t *);
+	tsc = clk->tsc_base + (int64_t)((double)(int64_t)(ts - clk->nic_base) * clk->tsc_per_tick);
+
+	/* a packet cannot arrive in the future */
+	return tsc > now ? now : tsc;
+}
+
+static inline uint64_t
+tsc_to_hwts(const struct demu_hwts_clock *clk, uint64_t tsc)
+{
+	return clk->nic_base + (int64_t)((double)(int64_t)(tsc - clk->tsc_base) / clk->tsc_per_tick);
+}
+#endif
+
+/*
+ * TX pacing (--tx-pacing).
+ * Instead of the token bucket, the worker gives each packet a departure
+ * time at which the previous packet has been serialized at limit_speed,
+ * and the TX thread releases the packet at that time. If the NIC supports
+ * DEV_TX_OFFLOAD_SEND_ON_TIMESTAMP, the departure time is converted to the
+ * NIC clock and the NIC launches the packet. Otherwise the TX thread spins
+ * on the TSC. The worker schedules packets at most PACING_HORIZON_US ahead,
+ * so that the queue builds up in rx_to_workers as with the token bucket.
+ */
+#define PACING_HORIZON_US 20
+#define ETHER_WIRE_OVERHEAD 24 /* preamble, SFD, IFG and CRC */
+
+static bool tx_pacing = false;
+static double pacing_cycles_per_byte = 0;
+static uint64_t pacing_horizon = 0;
+
+#if DEMU_MBUF_DYN
+static struct demu_hwts_clock txts_clock[RTE_MAX_ETHPORTS];
+static int txts_dynfield_offset = -1;
+static uint64_t txts_dynflag = 0;
+#endif
+
 static inline void
 pktmbuf_free_bulk(struct rte_mbuf *mbuf_table[], unsigned n)
 {
@@ -279,274 +768,3261 @@ tx_timer_cb(__attribute__((unused)) struct rte_timer *tmpTime, __attribute__((un
 	}
 }
 
+/*
+ * The run-to-completion loop runs rte_timer_manage() once per pass, which
+ * takes longer than the 1 us period under load, and the missed periods are
+ * not caught up. The loop refills the bucket by the elapsed TSC instead.
+ */
+static uint64_t token_refill_tsc = 0;
+
 static void
-delay_timer_cb(__attribute__((unused)) struct rte_timer *tmpTime, __attribute__((unused)) void *arg)
+tx_token_refill(uint64_t now)
 {
-	//dynamic latency changes latency by normal distribution with delayed jitter as a standard deviation.
-	delayed_time = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * normal_distribution(delayed_time_in_us, delayed_jitter);
+	uint64_t upper_limit_speed = (uint64_t)(max_speed / 100000);
+	uint64_t tsc_per_us = rte_get_tsc_hz() / US_PER_S;
+	uint64_t us = (now - token_refill_tsc) / tsc_per_us;
+
+	if (us == 0)
+		return;
+	token_refill_tsc += us * tsc_per_us;
+
+	if (amount_token >= upper_limit_speed)
+		return;
+
+	sub_amount_token += limit_speed * RTE_MIN(us, (uint64_t)US_PER_S);
+	amount_token += sub_amount_token / 1000000;
+	sub_amount_token %= 1000000;
+	if (amount_token > upper_limit_speed)
+		amount_token = upper_limit_speed;
 }
 
 static void
-demu_timer_loop(void)
+delay_timer_cb(__attribute__((unused)) struct rte_timer *tmpTime, __attribute__((unused)) void *arg)
 {
-	unsigned lcore_id;
-	uint64_t hz;
-	struct rte_timer timer;
-	struct rte_timer delay_timer;
+	//dynamic latency changes latency by normal distribution with delayed jitter as a standard deviation.
+	uint64_t us = normal_distribution(delayed_time_in_us, delayed_jitter);
 
-	lcore_id = rte_lcore_id();
-	hz = rte_get_timer_hz();
+	delayed_time = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * us;
+	decision_record(DECISION_JITTER, 0, us);
+}
 
-	RTE_LOG(INFO, DEMU, "Entering timer loop on lcore %u\n", lcore_id);
-	
-	if (limit_speed) {
-		rte_timer_init(&timer);
-		rte_timer_reset(&timer, hz / 1000000, PERIODICAL, lcore_id, tx_timer_cb, NULL);
+/*
+ * Scenario timeline (--scenario).
+ * A scenario file lists events which change the delay, the loss rate, the
+ * bandwidth, or the link state at a given time after DEMU starts
+ * forwarding, optionally with a linear ramp and for a limited duration.
+ * Events are applied by a single-shot rte_timer on the timer lcore (or the
+ * run-to-completion lcore of port 0), which is re-armed for the next event
+ * or the next ramp step. Every applied value is recorded in memory and
+ * written out on exit (--scenario-log).
+ */
+#define SCENARIO_MAX_EVENTS 1024
+#define SCENARIO_LOG_MAX 65536
+#define SCENARIO_RAMP_STEP_US 1000
+
+enum demu_scenario_param {
+	SCENARIO_DELAY, /* us */
+	SCENARIO_LOSS,  /* RANDOM_MAX is 100% */
+	SCENARIO_RATE,  /* bps, 0 is unlimited */
+	SCENARIO_LINK,  /* 1 is up, 0 is down */
+	SCENARIO_NB_PARAMS,
+};
 
-		RTE_LOG(INFO, DEMU, "  Linit speed is %lu bps\n", limit_speed);
-	}
-	
-	if (delayed_jitter) {
-		rte_timer_init(&delay_timer);
-		rte_timer_reset(&delay_timer, hz, PERIODICAL, lcore_id, delay_timer_cb, NULL);
+static const char * const scenario_param_name[SCENARIO_NB_PARAMS] = {
+	"delay", "loss", "rate", "link",
+};
 
-		RTE_LOG(INFO, DEMU, "  Delayed time is %lu us with delay jitter %lu us\n", delayed_time_in_us, delayed_jitter);
-	}
+struct demu_scenario_event {
+	uint64_t at_ms;
+	uint64_t ramp_ms;
+	uint64_t for_ms;
+	uint64_t value;
+	uint64_t prev; /* value before this event, restored after for_ms */
+	enum demu_scenario_param param;
+};
 
+/* An event is applied at its time, and restored for_ms later if given. */
+struct demu_scenario_step {
+	uint64_t at;
+	unsigned ev;
+	bool restore;
+};
 
-	while (!force_quit)
-		rte_timer_manage();
+struct demu_scenario_ramp {
+	bool active;
+	uint64_t start;
+	uint64_t end;
+	double from;
+	double to;
+};
+
+struct demu_scenario_log {
+	uint64_t at;
+	uint64_t value;
+	enum demu_scenario_param param;
+};
+
+static const char *scenario_file = NULL;
+static const char *scenario_log_file = NULL;
+static struct demu_scenario_event *scenario_events = NULL;
+static struct demu_scenario_step *scenario_steps = NULL;
+static unsigned scenario_nb_events = 0;
+static unsigned scenario_nb_steps = 0;
+static unsigned scenario_next_step = 0;
+static bool scenario_has_rate = false;
+static struct demu_scenario_ramp scenario_ramp[SCENARIO_NB_PARAMS];
+static struct demu_scenario_log *scenario_log = NULL;
+static unsigned scenario_nb_log = 0;
+static uint64_t scenario_start = 0;
+static struct timespec scenario_start_realtime;
+static struct rte_timer scenario_timer;
+
+static volatile bool link_down = false;
+
+static uint64_t
+scenario_get_param(enum demu_scenario_param param)
+{
+	switch (param) {
+	case SCENARIO_DELAY:
+		return delayed_time_in_us;
+	case SCENARIO_LOSS:
+		return loss_mode == LOSS_MODE_RANDOM ? loss_percent_1 : 0;
+	case SCENARIO_RATE:
+		return limit_speed;
+	case SCENARIO_LINK:
+	default:
+		return !link_down;
+	}
 }
 
 static void
-demu_tx_loop(unsigned portid)
+scenario_set_param(enum demu_scenario_param param, uint64_t value, uint64_t now)
 {
-	struct rte_mbuf *send_buf[PKT_BURST_TX];
-	struct rte_ring **cring;
-	unsigned lcore_id;
-	uint32_t numdeq = 0;
-	uint16_t sent;
-
-	lcore_id = rte_lcore_id();
+	switch (param) {
+	case SCENARIO_DELAY:
+		delayed_time_in_us = value;
+		delayed_time = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * value;
+		demu_stats->latency[1].target_us = value;
+		break;
+	case SCENARIO_LOSS:
+		loss_percent_1 = value;
+		loss_mode = value ? LOSS_MODE_RANDOM : LOSS_MODE_NONE;
+		break;
+	case SCENARIO_RATE:
+		if (tx_pacing && value)
+			pacing_cycles_per_byte = (double)rte_get_tsc_hz() * 8 / value;
+		limit_speed = value;
+		break;
+	case SCENARIO_LINK:
+		link_down = !value;
+		break;
+	default:
+		return;
+	}
 
-	RTE_LOG(INFO, DEMU, "Entering main tx loop on lcore %u portid %u\n", lcore_id, portid);
+	if (scenario_nb_log < SCENARIO_LOG_MAX) {
+		scenario_log[scenario_nb_log].at = now;
+		scenario_log[scenario_nb_log].param = param;
+		scenario_log[scenario_nb_log].value = value;
+		scenario_nb_log++;
+	}
+}
 
-	while (!force_quit) {
-		if (portid == 0)
-			cring = &workers_to_tx;
-		else
-			cring = &workers_to_tx2;
-		
-		numdeq = rte_ring_sc_dequeue_burst(*cring,
-				(void *)send_buf, PKT_BURST_TX, NULL);
+static void
+scenario_timer_cb(struct rte_timer *tim, __attribute__((unused)) void *arg)
+{
+	uint64_t hz = rte_get_timer_hz();
+	uint64_t now = rte_get_timer_cycles();
+	uint64_t next = UINT64_MAX;
+	struct demu_scenario_event *ev;
+	struct demu_scenario_ramp *ramp;
+	unsigned p;
+
+	while (scenario_next_step < scenario_nb_steps &&
+			scenario_steps[scenario_next_step].at <= now) {
+		struct demu_scenario_step *step = &scenario_steps[scenario_next_step++];
+
+		ev = &scenario_events[step->ev];
+		ramp = &scenario_ramp[ev->param];
+		ramp->active = false;
+
+		if (step->restore) {
+			scenario_set_param(ev->param, ev->prev, now);
+			continue;
+		}
 
-		if (unlikely(numdeq == 0))
+		ev->prev = scenario_get_param(ev->param);
+		if (ev->ramp_ms == 0) {
+			scenario_set_param(ev->param, ev->value, now);
 			continue;
+		}
 
-		sent = 0;
-		while (numdeq > sent)
-			sent += rte_eth_tx_burst(portid, 0, send_buf + sent, numdeq - sent);
+		ramp->active = true;
+		ramp->start = step->at;
+		ramp->end = step->at + hz / MS_PER_S * ev->ramp_ms;
+		ramp->from = ev->prev;
+		ramp->to = ev->value;
+	}
 
-#ifdef DEBUG_TX
-		if (tx_cnt < TX_STAT_BUF_SIZE) {
-			for (uint32_t i = 0; i < numdeq; i++) {
-				tx_stat[tx_cnt] = rte_rdtsc();
-				tx_cnt++;
-			}
+	for (p = 0; p < SCENARIO_NB_PARAMS; p++) {
+		ramp = &scenario_ramp[p];
+		if (!ramp->active)
+			continue;
+
+		if (now >= ramp->end) {
+			scenario_set_param(p, ramp->to, now);
+			ramp->active = false;
+			continue;
 		}
-#endif
+
+		scenario_set_param(p, ramp->from + (ramp->to - ramp->from) *
+			(now - ramp->start) / (ramp->end - ramp->start), now);
+		next = RTE_MIN(next, RTE_MIN(now + hz / US_PER_S * SCENARIO_RAMP_STEP_US, ramp->end));
 	}
+
+	if (scenario_next_step < scenario_nb_steps)
+		next = RTE_MIN(next, scenario_steps[scenario_next_step].at);
+
+	if (next != UINT64_MAX)
+		rte_timer_reset(tim, next > now ? next - now : 0, SINGLE, rte_lcore_id(),
+			scenario_timer_cb, NULL);
 }
 
+/* Convert the event times into timer cycles from now, and start the timeline */
 static void
-demu_rx_loop(unsigned portid)
+scenario_start_timeline(unsigned lcore_id)
 {
-	struct rte_mbuf *pkts_burst[PKT_BURST_RX], *rx2w_buffer[PKT_BURST_RX];
-	unsigned lcore_id;
+	uint64_t hz = rte_get_timer_hz();
+	unsigned i;
 
-	unsigned nb_rx, i;
-	unsigned nb_loss;
-	unsigned nb_dup;
-	uint32_t numenq;
+	clock_gettime(CLOCK_REALTIME, &scenario_start_realtime);
+	scenario_start = rte_get_timer_cycles();
 
-	lcore_id = rte_lcore_id();
+	for (i = 0; i < scenario_nb_steps; i++) {
+		struct demu_scenario_event *ev = &scenario_events[scenario_steps[i].ev];
+		uint64_t at_ms = ev->at_ms;
 
-	RTE_LOG(INFO, DEMU, "Entering main rx loop on lcore %u portid %u\n", lcore_id, portid);
+		if (scenario_steps[i].restore)
+			at_ms += ev->ramp_ms + ev->for_ms;
+		scenario_steps[i].at = scenario_start + hz / MS_PER_S * at_ms;
+	}
 
-	while (!force_quit) {
-		nb_rx = rte_eth_rx_burst((uint8_t) portid, 0, pkts_burst, PKT_BURST_RX);
+	rte_timer_init(&scenario_timer);
+	rte_timer_reset(&scenario_timer, 0, SINGLE, lcore_id, scenario_timer_cb, NULL);
 
-		if (likely(nb_rx == 0))
-			continue;
+	RTE_LOG(INFO, DEMU, "  Scenario %s with %u events\n", scenario_file, scenario_nb_events);
+}
 
-		nb_loss = 0;
-		nb_dup = 0;
+static void
+scenario_write_log(void)
+{
+	FILE *fp = stdout;
+	uint64_t hz = rte_get_timer_hz();
+	unsigned i;
+
+	if (scenario_log_file && (fp = fopen(scenario_log_file, "w")) == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot open %s\n", scenario_log_file);
+		return;
+	}
+
+	fprintf(fp, "# start %ld.%09ld\n", (long)scenario_start_realtime.tv_sec,
+		scenario_start_realtime.tv_nsec);
+	fprintf(fp, "# time[us] param value\n");
+	for (i = 0; i < scenario_nb_log; i++)
+		fprintf(fp, "%.3f %s %lu\n",
+			(double)(scenario_log[i].at - scenario_start) * US_PER_S / hz,
+			scenario_param_name[scenario_log[i].param], scenario_log[i].value);
+	if (scenario_nb_log == SCENARIO_LOG_MAX)
+		fprintf(fp, "# log is full\n");
+
+	if (fp != stdout)
+		fclose(fp);
+}
+
+static struct rte_timer tx_timer;
+static struct rte_timer delay_timer;
+
+/*
+ * Arm the timers of the token bucket and the delay jitter on a given lcore.
+ * With refill_by_tsc, the caller refills the bucket by tx_token_refill().
+ */
+static bool
+demu_timer_init(unsigned lcore_id, bool refill_by_tsc)
+{
+	uint64_t hz;
+	bool armed = false;
+
+	hz = rte_get_timer_hz();
+
+	if ((limit_speed || scenario_has_rate) && !tx_pacing) {
+		if (refill_by_tsc)
+			token_refill_tsc = rte_rdtsc();
+		else {
+			rte_timer_init(&tx_timer);
+			rte_timer_reset(&tx_timer, hz / 1000000, PERIODICAL, lcore_id, tx_timer_cb, NULL);
+			armed = true;
+		}
+
+		RTE_LOG(INFO, DEMU, "  Linit speed is %lu bps\n", limit_speed);
+	}
+	
+	if (delayed_jitter) {
+		rte_timer_init(&delay_timer);
+		rte_timer_reset(&delay_timer, hz, PERIODICAL, lcore_id, delay_timer_cb, NULL);
+		armed = true;
+
+		RTE_LOG(INFO, DEMU, "  Delayed time is %lu us with delay jitter %lu us\n", delayed_time_in_us, delayed_jitter);
+	}
+
+	if (scenario_file) {
+		scenario_start_timeline(lcore_id);
+		armed = true;
+	}
+
+	return armed;
+}
+
+static void
+demu_timer_loop(void)
+{
+	unsigned lcore_id;
+
+	lcore_id = rte_lcore_id();
+
+	RTE_LOG(INFO, DEMU, "Entering timer loop on lcore %u\n", lcore_id);
+
+	demu_timer_init(lcore_id, false);
+
+	while (!force_quit)
+		rte_timer_manage();
+}
+
+/*
+ * Byte arena delay line (--arena).
+ * For the port 0 direction, the RX thread copies each packet into a large
+ * contiguous ring of bytes with an 8-byte header, and frees the mbuf at
+ * once. The worker rebuilds an mbuf when the packet is released. A 64B
+ * packet takes 72 bytes of the arena instead of a 2KB mbuf, so a large BDP
+ * of short packets fits in a few GB.
+ * The header holds the lower 48 bits of the arrival TSC and the packet
+ * length; a zero length marks the unused space at the end of the arena.
+ * head and tail are byte counters which only increase, and are written
+ * only by the RX thread and the worker thread, respectively.
+ */
+#define ARENA_ALIGN 8
+#define ARENA_HDR_SIZE 8
+#define ARENA_TSC_MASK ((1ULL << 48) - 1)
+/* a packet is rebuilt in a single mbuf, so it must fit in its data room */
+#define ARENA_MAX_PKT_LEN (MEMPOOL_BUF_SIZE - RTE_PKTMBUF_HEADROOM)
+
+struct demu_arena {
+	uint8_t *base;
+	uint64_t size;
+	uint64_t head __rte_cache_aligned;
+	uint64_t tail __rte_cache_aligned;
+};
+
+static uint64_t arena_size = 0;
+static struct demu_arena delay_arena;
+
+static inline uint64_t *
+arena_hdr(struct demu_arena *a, uint64_t pos)
+{
+	return (uint64_t *)(a->base + pos % a->size);
+}
+
+/*
+ * Copy packets into the arena, and free them. Packets too long for an mbuf
+ * are dropped. Return the number of packets consumed.
+ */
+static unsigned
+arena_enqueue(struct demu_arena *a, struct rte_mbuf **pkts, unsigned n)
+{
+	uint64_t head = a->head;
+	uint64_t tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+	uint64_t off, rec;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		struct rte_mbuf *m = pkts[i];
+		struct rte_mbuf *seg;
+		uint8_t *dst;
+
+		if (unlikely(m->pkt_len > ARENA_MAX_PKT_LEN)) {
+			port_statistics[0].rx_worker_dropped++;
+			rte_pktmbuf_free(m);
+			continue;
+		}
+
+		rec = RTE_ALIGN_CEIL(ARENA_HDR_SIZE + m->pkt_len, ARENA_ALIGN);
+		off = head % a->size;
+
+		/* a record does not wrap around, so skip the rest of the arena */
+		if (off + rec > a->size) {
+			if (head + (a->size - off) + rec - tail > a->size)
+				break;
+			*arena_hdr(a, head) = 0;
+			head += a->size - off;
+			off = 0;
+		}
+		if (head + rec - tail > a->size)
+			break;
+
+		dst = a->base + off + ARENA_HDR_SIZE;
+		for (seg = m; seg != NULL; seg = seg->next) {
+			rte_memcpy(dst, rte_pktmbuf_mtod(seg, void *), seg->data_len);
+			dst += seg->data_len;
+		}
+		*arena_hdr(a, head) = (demu_get_tsc(m) << 16) | m->pkt_len;
+		head += rec;
+
+		rte_pktmbuf_free(m);
+	}
+
+	__atomic_store_n(&a->head, head, __ATOMIC_RELEASE);
+
+	return i;
+}
+
+/* Return false if a packet of len bytes must wait for the bandwidth limitation */
+static inline bool
+worker_shape(uint64_t *next_depart, uint64_t now, uint32_t len, uint64_t *depart)
+{
+	if (limit_speed && tx_pacing) {
+		if (*next_depart < now)
+			*next_depart = now;
+		else if (*next_depart - now > pacing_horizon)
+			return false;
+
+		*depart = *next_depart;
+		*next_depart += (uint64_t)((len + ETHER_WIRE_OVERHEAD) * pacing_cycles_per_byte);
+	} else if (limit_speed) {
+		uint16_t pkt_size_bit = len * 8;
+
+		if (amount_token >= pkt_size_bit)
+			amount_token -= pkt_size_bit;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Pass packets to the TX thread at once. The callers never take more
+ * packets than the free entries of cring, but count and drop the rest
+ * rather than holding them if the ring is full.
+ */
+static inline unsigned
+worker_enqueue(unsigned portid, struct rte_ring *cring, struct rte_mbuf **pkts, unsigned n)
+{
+	unsigned nb_enq;
+
+	if (n == 0)
+		return 0;
+
+	nb_enq = rte_ring_sp_enqueue_burst(cring, (void *)pkts, n, NULL);
+	if (unlikely(nb_enq < n)) {
+		port_statistics[portid].worker_tx_dropped += n - nb_enq;
+		pktmbuf_free_bulk(&pkts[nb_enq], n - nb_enq);
+	}
+
+	return n;
+}
+
+/* Rebuild the packets whose delay has passed, and pass them to the TX thread */
+static unsigned
+arena_dequeue(struct demu_arena *a, uint64_t *next_depart, struct rte_ring *cring)
+{
+	uint64_t head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = a->tail;
+	uint64_t hdr, now, depart = 0;
+	unsigned nb_free, nb_sent = 0;
+	struct rte_mbuf *m, *w2t_buffer[PKT_BURST_WORKER];
+	uint16_t len;
+
+	/* this worker is the only producer, so free entries never decrease */
+	nb_free = RTE_MIN(rte_ring_free_count(cring), PKT_BURST_WORKER);
+
+	while (tail != head && nb_sent < nb_free) {
+		hdr = *arena_hdr(a, tail);
+		len = hdr & 0xffff;
+		if (len == 0) {
+			tail += a->size - tail % a->size;
+			continue;
+		}
+
+		now = rte_rdtsc();
+		if (((now - (hdr >> 16)) & ARENA_TSC_MASK) < delayed_time)
+			break;
+
+		m = rte_pktmbuf_alloc(demu_pktmbuf_pool);
+		if (unlikely(m == NULL))
+			break;
+
+		if (!worker_shape(next_depart, now, len, &depart)) {
+			rte_pktmbuf_free(m);
+			break;
+		}
+
+		rte_memcpy(rte_pktmbuf_mtod(m, void *), a->base + tail % a->size + ARENA_HDR_SIZE, len);
+		m->data_len = len;
+		m->pkt_len = len;
+		demu_set_tsc(m, now - ((now - (hdr >> 16)) & ARENA_TSC_MASK));
+		if (tx_pacing)
+			demu_set_depart(m, depart);
+
+		w2t_buffer[nb_sent++] = m;
+		tail += RTE_ALIGN_CEIL(ARENA_HDR_SIZE + len, ARENA_ALIGN);
+	}
+
+	__atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+
+	return worker_enqueue(0, cring, w2t_buffer, nb_sent);
+}
+
+/*
+ * Delay accuracy probe (--latency-probe N).
+ * The TX stage records the residence time of every Nth packet, from the
+ * RX stamp to the hand-off to the NIC, into the histogram of the egress
+ * port in the shared statistics. demu-stat shows its quantiles against
+ * the configured delay, and DEMU prints them on exit.
+ */
+static unsigned latency_probe = 0;
+static unsigned probe_skip[DEMU_LATENCY_PORTS];
+
+static inline void
+demu_probe(unsigned portid, struct rte_mbuf **pkts, unsigned n, uint64_t now)
+{
+	struct demu_latency_hist *h = &demu_stats->latency[portid];
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		if (++probe_skip[portid] < latency_probe)
+			continue;
+		probe_skip[portid] = 0;
+		demu_hist_record(h, now - demu_get_tsc(pkts[i]));
+	}
+}
+
+/*
+ * Cross traffic (--cross-traffic).
+ * The RX stage of port 0 synthesizes UDP packets from demu_xt_pool and
+ * enqueues them into rx_to_workers along with the received packets, so
+ * that they share the delay, the queue and the bandwidth with the real
+ * traffic. They are discarded by the TX stage of port 1 unless
+ * --cross-traffic-tx is given.
+ * Packets are sent at the given rate as constant bit rate, as a Poisson
+ * process, or in on/off periods with exponentially distributed lengths.
+ * The size is fixed or drawn from a list of recorded sizes.
+ */
+#define XT_POOL_PKTS 65536
+#define XT_MAX_SIZES 65536
+#define XT_MIN_SIZE 60
+#define XT_MAX_SIZE 1514
+#define XT_HDR_SIZE 42 /* Ethernet, IPv4 and UDP */
+#define XT_CATCHUP_US 1000
+
+enum demu_xt_type {
+	XT_TYPE_CBR,
+	XT_TYPE_POISSON,
+	XT_TYPE_ONOFF,
+};
+
+struct demu_xt {
+	enum demu_xt_type type;
+	uint64_t rate;
+	uint16_t size;
+	const char *sizes_file;
+	uint64_t on_ms;
+	uint64_t off_ms;
+
+	double cycles_per_byte;
+	uint16_t *sizes;
+	unsigned nb_sizes;
+	uint64_t next;          /* TSC when the next packet is sent */
+	uint64_t period_end;    /* TSC when the current on period ends */
+	uint8_t hdr[XT_HDR_SIZE];
+};
+
+static bool xt_enabled = false;
+static bool xt_transmit = false;
+static struct demu_xt cross_traffic;
+struct rte_mempool *demu_xt_pool = NULL;
+
+static inline uint64_t
+xt_exponential(double mean)
+{
+	return (uint64_t)(-log(demu_rand_double()) * mean);
+}
+
+static int
+xt_load_sizes(struct demu_xt *xt)
+{
+	FILE *fp;
+	unsigned long len;
+
+	xt->sizes = rte_malloc("xt_sizes", sizeof(uint16_t) * XT_MAX_SIZES, 0);
+	if (xt->sizes == NULL)
+		return -1;
+
+	fp = fopen(xt->sizes_file, "r");
+	if (fp == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot open %s: %s\n", xt->sizes_file, strerror(errno));
+		goto error;
+	}
+	while (xt->nb_sizes < XT_MAX_SIZES && fscanf(fp, "%lu", &len) == 1)
+		xt->sizes[xt->nb_sizes++] = RTE_MIN(RTE_MAX(len, XT_MIN_SIZE), XT_MAX_SIZE);
+	fclose(fp);
+
+	if (xt->nb_sizes == 0) {
+		RTE_LOG(ERR, DEMU, "No packet size in %s\n", xt->sizes_file);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	rte_free(xt->sizes);
+	xt->sizes = NULL;
+	return -1;
+}
+
+/* Ethernet, IPv4 (198.18.0.1 to 198.18.0.2) and UDP (port 9) headers */
+static void
+xt_init_header(struct demu_xt *xt)
+{
+	static const uint8_t hdr[XT_HDR_SIZE] = {
+		0x02, 0x00, 0x00, 0x00, 0x00, 0x02,     /* destination */
+		0x02, 0x00, 0x00, 0x00, 0x00, 0x01,     /* source */
+		0x08, 0x00,
+		0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x40, IPPROTO_UDP, 0x00, 0x00,
+		198, 18, 0, 1,
+		198, 18, 0, 2,
+		0x00, 0x09, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00,
+	};
+
+	memcpy(xt->hdr, hdr, sizeof(hdr));
+}
+
+static void
+xt_fill(struct demu_xt *xt, uint8_t *p, uint16_t len)
+{
+	uint32_t sum = 0;
+	uint16_t ip_len = len - 14, udp_len = len - 34;
+	unsigned i;
+
+	memcpy(p, xt->hdr, XT_HDR_SIZE);
+	p[16] = ip_len >> 8;
+	p[17] = ip_len & 0xff;
+	p[38] = udp_len >> 8;
+	p[39] = udp_len & 0xff;
+
+	for (i = 14; i < 34; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	p[24] = sum >> 8;
+	p[25] = sum & 0xff;
+}
+
+/* Schedule the packet after one of len bytes */
+static void
+xt_advance(struct demu_xt *xt, uint16_t len)
+{
+	double gap = (len + ETHER_WIRE_OVERHEAD) * xt->cycles_per_byte;
+	uint64_t tsc_per_ms = rte_get_tsc_hz() / MS_PER_S;
+
+	if (xt->type == XT_TYPE_POISSON)
+		xt->next += xt_exponential(gap);
+	else
+		xt->next += (uint64_t)gap;
+
+	if (xt->type == XT_TYPE_ONOFF && xt->next >= xt->period_end) {
+		/* skip an off period and start the next on period */
+		xt->next = xt->period_end + xt_exponential(xt->off_ms * tsc_per_ms);
+		xt->period_end = xt->next + xt_exponential(xt->on_ms * tsc_per_ms);
+	}
+}
+
+/* Generate the packets whose time has come, and pass them to the worker */
+static unsigned
+xt_inject(uint64_t now)
+{
+	struct demu_xt *xt = &cross_traffic;
+	struct rte_mbuf *pkts[PKT_BURST_RX];
+	uint64_t catchup = rte_get_tsc_hz() / US_PER_S * XT_CATCHUP_US;
+	unsigned n = 0, numenq;
+	uint16_t len;
+
+	if (likely(xt->next > now))
+		return 0;
+
+	/* do not try to catch up with a long stall */
+	if (now - xt->next > catchup)
+		xt->next = now;
+
+	while (n < PKT_BURST_RX && xt->next <= now) {
+		len = xt->nb_sizes ? xt->sizes[demu_rand() % xt->nb_sizes] : xt->size;
+		/* the cross traffic is lost on a down link as the real traffic is */
+		if (unlikely(link_down)) {
+			port_statistics[0].xt_dropped++;
+			xt_advance(xt, len);
+			continue;
+		}
+		pkts[n] = rte_pktmbuf_alloc(demu_xt_pool);
+		if (unlikely(pkts[n] == NULL)) {
+			port_statistics[0].xt_dropped++;
+			xt_advance(xt, len);
+			continue;
+		}
+		xt_fill(xt, rte_pktmbuf_mtod(pkts[n], uint8_t *), len);
+		pkts[n]->data_len = len;
+		pkts[n]->pkt_len = len;
+		demu_set_tsc(pkts[n], xt->next);
+		xt_advance(xt, len);
+		n++;
+	}
+
+	numenq = rte_ring_sp_enqueue_burst(rx_to_workers, (void *)pkts, n, NULL);
+	port_statistics[0].xt_generated += n;
+	if (unlikely(numenq < n)) {
+		port_statistics[0].xt_dropped += n - numenq;
+		pktmbuf_free_bulk(&pkts[numenq], n - numenq);
+	}
+
+	return n;
+}
+
+static int
+xt_init(struct demu_xt *xt)
+{
+	if (xt->sizes_file && xt_load_sizes(xt) < 0)
+		return -1;
+
+	xt_init_header(xt);
+	xt->cycles_per_byte = (double)rte_get_tsc_hz() * 8 / xt->rate;
+	xt->next = rte_rdtsc();
+	xt->period_end = xt->type == XT_TYPE_ONOFF ?
+		xt->next + xt_exponential(xt->on_ms * (rte_get_tsc_hz() / MS_PER_S)) : UINT64_MAX;
+
+	return 0;
+}
+
+/* Remove cross traffic from a burst to send */
+static inline unsigned
+xt_filter(struct rte_mbuf **pkts, unsigned n)
+{
+	unsigned i, nb_kept = 0;
+
+	for (i = 0; i < n; i++) {
+		if (pkts[i]->pool == demu_xt_pool)
+			rte_pktmbuf_free(pkts[i]);
+		else
+			pkts[nb_kept++] = pkts[i];
+	}
+
+	return nb_kept;
+}
+
+/*
+ * The TX thread retries a burst while the NIC is full, and drops the rest
+ * of it only after the NIC has made no progress for TX_BURST_TIMEOUT_US.
+ * Otherwise a stalled port would stop the TX thread, and the rings behind
+ * it would never drain, while a ring briefly full at the line rate is not
+ * turned into loss.
+ */
+#define TX_BURST_TIMEOUT_US 500
+
+static inline void
+demu_tx_send(unsigned portid, struct rte_mbuf **pkts, unsigned n)
+{
+	unsigned sent = 0;
+	uint64_t deadline = 0;
+	uint16_t nb_tx;
+
+	while (sent < n) {
+		nb_tx = rte_eth_tx_burst(portid, 0, pkts + sent, n - sent);
+		sent += nb_tx;
+		if (nb_tx) {
+			deadline = 0;
+			continue;
+		}
+		if (deadline == 0)
+			deadline = rte_rdtsc() + rte_get_tsc_hz() / US_PER_S * TX_BURST_TIMEOUT_US;
+		else if (rte_rdtsc() > deadline) {
+			port_statistics[portid].dropped += n - sent;
+			pktmbuf_free_bulk(&pkts[sent], n - sent);
+			break;
+		}
+	}
+
+	port_statistics[portid].tx += sent;
+}
+
+/*
+ * Offline mode (--pcap-in FILE --pcap-out FILE).
+ * Packets in a pcap file are passed through the impairment pipeline of
+ * port 0 on the main lcore, and the packets leaving port 1 are written
+ * to another pcap file with their emulated departure times. Time only
+ * moves from one event to the next: the arrival of a packet, the
+ * release of the head packet of the worker, a jitter update, or the
+ * next cross traffic packet. So a trace is processed as fast as the
+ * CPU allows, without NICs. The token bucket runs on a timer and is
+ * replaced by TX pacing, which gives exact departure times.
+ * The packets in flight take mbufs as in a live run, so the pool is sized
+ * by --buffer-pkts, and a run which exceeds it fails instead of dropping
+ * packets that a live run would have kept.
+ */
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_SNAPLEN 65535
+#define PCAP_LINKTYPE_ETHERNET 1
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_pkt_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;       /* usec or nsec */
+	uint32_t caplen;
+	uint32_t len;
+};
+
+static const char *pcap_in_file = NULL;
+static const char *pcap_out_file = NULL;
+
+static struct {
+	FILE *in;
+	FILE *out;
+	bool swapped;
+	bool nsec;
+	uint64_t first_ns;
+	uint64_t base_tsc;
+	double tsc_per_ns;
+	uint64_t read;
+	uint64_t written;
+	uint64_t too_long;
+} offline_io;
+
+static inline uint32_t
+pcap_u32(uint32_t v)
+{
+	return offline_io.swapped ? __builtin_bswap32(v) : v;
+}
+
+static int
+pcap_open(void)
+{
+	struct pcap_file_header hdr;
+
+	offline_io.in = fopen(pcap_in_file, "r");
+	if (offline_io.in == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot open %s: %s\n", pcap_in_file, strerror(errno));
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, offline_io.in) != 1) {
+		RTE_LOG(ERR, DEMU, "%s is not a pcap file\n", pcap_in_file);
+		return -1;
+	}
+
+	switch (hdr.magic) {
+	case PCAP_MAGIC_USEC:
+		break;
+	case PCAP_MAGIC_NSEC:
+		offline_io.nsec = true;
+		break;
+	default:
+		offline_io.swapped = true;
+		if (hdr.magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+			offline_io.nsec = true;
+		else if (hdr.magic != __builtin_bswap32(PCAP_MAGIC_USEC)) {
+			RTE_LOG(ERR, DEMU, "%s is not a pcap file\n", pcap_in_file);
+			return -1;
+		}
+	}
+	if (pcap_u32(hdr.linktype) != PCAP_LINKTYPE_ETHERNET)
+		RTE_LOG(WARNING, DEMU, "%s is not Ethernet, flows are not classified\n", pcap_in_file);
+
+	offline_io.out = fopen(pcap_out_file, "w");
+	if (offline_io.out == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot open %s: %s\n", pcap_out_file, strerror(errno));
+		return -1;
+	}
+
+	/* nanosecond timestamps in the native byte order */
+	hdr.magic = PCAP_MAGIC_NSEC;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.thiszone = 0;
+	hdr.sigfigs = 0;
+	hdr.snaplen = PCAP_SNAPLEN;
+	hdr.linktype = pcap_u32(hdr.linktype);
+	if (fwrite(&hdr, sizeof(hdr), 1, offline_io.out) != 1)
+		return -1;
+
+	offline_io.tsc_per_ns = (double)rte_get_tsc_hz() / NS_PER_S;
+
+	return 0;
+}
+
+/* Read the next packet into buf, and return its length, or -1 at the end */
+static int
+pcap_read(uint8_t *buf, uint64_t *ts_ns)
+{
+	struct pcap_pkt_header hdr;
+	uint32_t caplen;
+
+	if (fread(&hdr, sizeof(hdr), 1, offline_io.in) != 1)
+		return -1;
+
+	caplen = pcap_u32(hdr.caplen);
+	if (caplen > PCAP_SNAPLEN || fread(buf, caplen, 1, offline_io.in) != 1)
+		return -1;
+
+	*ts_ns = (uint64_t)pcap_u32(hdr.ts_sec) * NS_PER_S +
+		pcap_u32(hdr.ts_frac) * (offline_io.nsec ? 1 : 1000);
+
+	return caplen;
+}
+
+static inline uint64_t
+offline_ns_to_tsc(uint64_t ns)
+{
+	return offline_io.base_tsc + (uint64_t)((ns - offline_io.first_ns) * offline_io.tsc_per_ns);
+}
+
+static inline uint64_t
+offline_tsc_to_ns(uint64_t tsc)
+{
+	return offline_io.first_ns + (uint64_t)((tsc - offline_io.base_tsc) / offline_io.tsc_per_ns);
+}
+
+/* Write the packets leaving port 1, at their departure time if paced */
+static void
+offline_tx(struct rte_mbuf **pkts, unsigned n, bool paced)
+{
+	struct pcap_pkt_header hdr;
+	uint64_t t, ns;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		t = virtual_tsc;
+		if (paced)
+			t = RTE_MAX(t, demu_get_depart(pkts[i]));
+		if (latency_probe)
+			demu_probe(1, &pkts[i], 1, t);
+
+		ns = offline_tsc_to_ns(t);
+		hdr.ts_sec = ns / NS_PER_S;
+		hdr.ts_frac = ns % NS_PER_S;
+		hdr.caplen = rte_pktmbuf_data_len(pkts[i]);
+		hdr.len = rte_pktmbuf_pkt_len(pkts[i]);
+		if (fwrite(&hdr, sizeof(hdr), 1, offline_io.out) != 1 ||
+				fwrite(rte_pktmbuf_mtod(pkts[i], void *), hdr.caplen, 1, offline_io.out) != 1)
+			port_statistics[1].dropped++;
+		else
+			offline_io.written++;
+	}
+
+	port_statistics[1].tx += n;
+	pktmbuf_free_bulk(pkts, n);
+}
+
+/*
+ * Each stage of the pipeline is split into a function which processes one
+ * burst and returns the number of packets it handled. The dedicated
+ * threads call it in a loop, while the run-to-completion mode calls all
+ * the stages of a direction in turn on a single lcore.
+ *
+ * The stages are written as always-inline templates (*_dp) which take a
+ * constant set of the features below. demu_launch_one_lcore() runs the
+ * loop instantiated for the features of the port, so that the per-packet
+ * branches and loads of the disabled features are compiled out. The
+ * run-to-completion and offline modes call the plain functions, which
+ * pass the same features at run time.
+ */
+#define DP_RX_LOSS 0x1          /* loss_event() */
+#define DP_RX_DUP 0x2           /* duplication */
+#define DP_RX_NB_VARIANTS 4
+
+#define DP_W_DELAY 0x1          /* delay and shaping of port 0 */
+#define DP_W_SHAPE 0x2          /* bandwidth limitation */
+#define DP_W_PACED 0x4          /* departure time of TX pacing */
+#define DP_W_NB_VARIANTS 8
+
+#define DP_TX_PACED 0x1         /* release at the departure time */
+#define DP_TX_PROBE 0x2         /* latency probe */
+#define DP_TX_NB_VARIANTS 4
+
+static unsigned rx_features[RTE_MAX_ETHPORTS];
+static unsigned worker_features[RTE_MAX_ETHPORTS];
+static unsigned tx_features[RTE_MAX_ETHPORTS];
+
+/*
+ * The TX thread waits for the departure time of each paced packet, but
+ * the run-to-completion mode shares the lcore with RX and the worker, so
+ * it sends only the packets whose time has come and holds the rest of
+ * the burst for the next pass.
+ */
+struct demu_tx_state {
+	uint16_t n;     /* packets in the burst */
+	uint16_t i;     /* first packet not sent yet */
+	struct rte_mbuf *buf[MAX_PKT_BURST];
+};
+
+static struct demu_tx_state tx_state[RTE_MAX_ETHPORTS];
+static unsigned rtc_cores = 0;
+
+static inline __attribute__((always_inline)) unsigned
+demu_tx_burst_dp(unsigned portid, const unsigned features)
+{
+	struct demu_tx_state *ts = &tx_state[portid];
+	struct rte_mbuf **send_buf = ts->buf;
+	struct rte_ring *cring;
+	uint32_t numdeq = 0, nb_xt = 0;
+	uint16_t sent, first, ready;
+	uint64_t now;
+	bool paced = features & DP_TX_PACED;
+#if DEMU_MBUF_DYN
+	struct demu_hwts_clock *clk = &txts_clock[portid];
+#endif
+
+	if (paced && ts->i != ts->n) {
+		numdeq = ts->n;
+		first = ts->i;
+		goto paced_send;
+	}
+
+	if (portid == 0)
+		cring = workers_to_tx;
+	else
+		cring = workers_to_tx2;
+
+	numdeq = rte_ring_sc_dequeue_burst(cring,
+			(void *)send_buf, port_params[portid].tx_burst, NULL);
+
+	if (unlikely(numdeq == 0))
+		return 0;
+
+	if (portid == 1 && xt_enabled && !xt_transmit) {
+		nb_xt = numdeq;
+		numdeq = xt_filter(send_buf, numdeq);
+		nb_xt -= numdeq;
+	}
+
+	if (unlikely(offline)) {
+		offline_tx(send_buf, numdeq, paced);
+		return numdeq + nb_xt;
+	}
+
+	first = 0;
+	sent = 0;
+#if DEMU_MBUF_DYN
+	if (paced && clk->enabled) {
+		/* the NIC launches each packet at its departure time */
+		now = rte_rdtsc();
+		if (unlikely(now >= clk->next_sync))
+			hwts_sync(portid, clk);
+		for (ready = 0; ready < numdeq; ready++) {
+			*RTE_MBUF_DYNFIELD(send_buf[ready], txts_dynfield_offset, uint64_t *) =
+				tsc_to_hwts(clk, demu_get_depart(send_buf[ready]));
+			send_buf[ready]->ol_flags |= txts_dynflag;
+		}
+	} else
+#endif
+	if (paced) {
+paced_send:
+		/* release packets whose departure time has come */
+		sent = first;
+		while (numdeq > sent) {
+			now = rte_rdtsc();
+			ready = sent;
+			while (ready < numdeq && demu_get_depart(send_buf[ready]) <= now)
+				ready++;
+			if (ready == sent) {
+				if (rtc_cores)
+					break;
+				continue;
+			}
+			if (features & DP_TX_PROBE)
+				demu_probe(portid, send_buf + sent, ready - sent, now);
+			demu_tx_send(portid, send_buf + sent, ready - sent);
+			sent = ready;
+		}
+		ts->n = numdeq;
+		ts->i = sent;
+		if (sent != numdeq)
+			return sent - first + nb_xt;
+	}
+
+	if (numdeq > sent) {
+		if (features & DP_TX_PROBE)
+			demu_probe(portid, send_buf + sent, numdeq - sent, rte_rdtsc());
+		demu_tx_send(portid, send_buf + sent, numdeq - sent);
+	}
+
+#ifdef DEBUG_TX
+	if (tx_cnt < TX_STAT_BUF_SIZE) {
+		for (uint32_t i = first; i < numdeq; i++) {
+			tx_stat[tx_cnt] = rte_rdtsc();
+			tx_cnt++;
+		}
+	}
+#endif
+
+	return numdeq - first + nb_xt;
+}
+
+static unsigned
+demu_tx_burst(unsigned portid)
+{
+	return demu_tx_burst_dp(portid, tx_features[portid]);
+}
+
+#define DEMU_TX_LOOP(features) \
+static void \
+demu_tx_loop_##features(unsigned portid) \
+{ \
+	while (!force_quit) \
+		PROFILE_STAGE(DEMU_STAGE_TX, portid, demu_tx_burst_dp(portid, features)); \
+}
+DEMU_TX_LOOP(0)
+DEMU_TX_LOOP(1)
+DEMU_TX_LOOP(2)
+DEMU_TX_LOOP(3)
+
+static void (* const demu_tx_loops[DP_TX_NB_VARIANTS])(unsigned) = {
+	demu_tx_loop_0, demu_tx_loop_1, demu_tx_loop_2, demu_tx_loop_3,
+};
+
+static void
+demu_tx_loop(unsigned portid)
+{
+	unsigned lcore_id;
+
+	lcore_id = rte_lcore_id();
+
+	RTE_LOG(INFO, DEMU, "Entering main tx loop on lcore %u portid %u features 0x%x\n",
+		lcore_id, portid, tx_features[portid]);
+
+	demu_tx_loops[tx_features[portid]](portid);
+}
+
+/*
+ * Selective impairment (--impair).
+ * Only the packets from port 0 which match one of the rules are emulated,
+ * and the others (e.g., ARP and control traffic) are forwarded to port 1
+ * right away through the second TX queue of port 1 (STEER_FAST_TXQ) by
+ * the RX thread. Where the NIC supports rte_flow, matching packets are
+ * steered to the second RX queue of port 0 (STEER_IMPAIR_RXQ), and the
+ * rest arrive at the first one without inspection. Otherwise (e.g., veth
+ * with af_packet), the RX thread classifies packets in software.
+ */
+#define MAX_IMPAIR_RULES 8
+#define STEER_FAST_RXQ 0
+#define STEER_IMPAIR_RXQ 1
+#define STEER_FAST_TXQ 1
+
+/* IPv4 match rule, in network byte order. Zero matches any value. */
+struct demu_impair_rule {
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+};
+
+static struct demu_impair_rule impair_rules[MAX_IMPAIR_RULES];
+static unsigned nb_impair_rules = 0;
+static bool steer_hw = false;
+static uint16_t steer_nb_rxq = 1;
+
+static inline bool
+impair_match(struct rte_mbuf *m)
+{
+	const uint8_t *p = rte_pktmbuf_mtod(m, const uint8_t *);
+	const struct demu_impair_rule *r;
+	uint32_t src_ip, dst_ip;
+	uint16_t src_port = 0, dst_port = 0;
+	uint8_t proto;
+	unsigned i, l4;
+
+	if (m->data_len < 34 || p[12] != 0x08 || p[13] != 0x00)
+		return false;
+
+	proto = p[23];
+	memcpy(&src_ip, p + 26, 4);
+	memcpy(&dst_ip, p + 30, 4);
+	l4 = 14 + (p[14] & 0xf) * 4;
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && m->data_len >= l4 + 4) {
+		memcpy(&src_port, p + l4, 2);
+		memcpy(&dst_port, p + l4 + 2, 2);
+	}
+
+	for (i = 0; i < nb_impair_rules; i++) {
+		r = &impair_rules[i];
+		if ((!r->proto || r->proto == proto) &&
+				(!r->src_ip || r->src_ip == src_ip) &&
+				(!r->dst_ip || r->dst_ip == dst_ip) &&
+				(!r->src_port || r->src_port == src_port) &&
+				(!r->dst_port || r->dst_port == dst_port))
+			return true;
+	}
+
+	return false;
+}
+
+/* Install the rules as rte_flow rules steering to STEER_IMPAIR_RXQ */
+static bool
+impair_flow_create(unsigned portid)
+{
+	struct rte_flow_attr attr = { .ingress = 1 };
+	struct rte_flow_action_queue queue = { .index = STEER_IMPAIR_RXQ };
+	struct rte_flow_action action[] = {
+		{ .type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &queue },
+		{ .type = RTE_FLOW_ACTION_TYPE_END },
+	};
+	struct rte_flow_item pattern[4];
+	struct rte_flow_item_ipv4 ip_spec, ip_mask;
+	struct rte_flow_item_tcp tcp_spec, tcp_mask;
+	struct rte_flow_item_udp udp_spec, udp_mask;
+	struct rte_flow_error error;
+	const struct demu_impair_rule *r;
+	unsigned i;
+
+	for (i = 0; i < nb_impair_rules; i++) {
+		r = &impair_rules[i];
+		memset(pattern, 0, sizeof(pattern));
+		memset(&ip_spec, 0, sizeof(ip_spec));
+		memset(&ip_mask, 0, sizeof(ip_mask));
+		memset(&tcp_spec, 0, sizeof(tcp_spec));
+		memset(&tcp_mask, 0, sizeof(tcp_mask));
+		memset(&udp_spec, 0, sizeof(udp_spec));
+		memset(&udp_mask, 0, sizeof(udp_mask));
+
+		ip_spec.hdr.src_addr = r->src_ip;
+		ip_mask.hdr.src_addr = r->src_ip ? UINT32_MAX : 0;
+		ip_spec.hdr.dst_addr = r->dst_ip;
+		ip_mask.hdr.dst_addr = r->dst_ip ? UINT32_MAX : 0;
+		ip_spec.hdr.next_proto_id = r->proto;
+		ip_mask.hdr.next_proto_id = r->proto ? UINT8_MAX : 0;
+
+		pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+		pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
+		pattern[1].spec = &ip_spec;
+		pattern[1].mask = &ip_mask;
+		pattern[2].type = RTE_FLOW_ITEM_TYPE_END;
+
+		if (r->proto == IPPROTO_TCP) {
+			tcp_spec.hdr.src_port = r->src_port;
+			tcp_mask.hdr.src_port = r->src_port ? UINT16_MAX : 0;
+			tcp_spec.hdr.dst_port = r->dst_port;
+			tcp_mask.hdr.dst_port = r->dst_port ? UINT16_MAX : 0;
+			pattern[2].type = RTE_FLOW_ITEM_TYPE_TCP;
+			pattern[2].spec = &tcp_spec;
+			pattern[2].mask = &tcp_mask;
+		} else if (r->proto == IPPROTO_UDP) {
+			udp_spec.hdr.src_port = r->src_port;
+			udp_mask.hdr.src_port = r->src_port ? UINT16_MAX : 0;
+			udp_spec.hdr.dst_port = r->dst_port;
+			udp_mask.hdr.dst_port = r->dst_port ? UINT16_MAX : 0;
+			pattern[2].type = RTE_FLOW_ITEM_TYPE_UDP;
+			pattern[2].spec = &udp_spec;
+			pattern[2].mask = &udp_mask;
+		}
+		pattern[3].type = RTE_FLOW_ITEM_TYPE_END;
+
+		if (rte_flow_validate(portid, &attr, pattern, action, &error) != 0 ||
+				rte_flow_create(portid, &attr, pattern, action, &error) == NULL) {
+			RTE_LOG(WARNING, DEMU, "  Port %u cannot steer impaired traffic: %s\n",
+				portid, error.message ? error.message : "unknown error");
+			rte_flow_flush(portid, &error);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Forward unimpaired packets to port 1 */
+static inline void
+demu_fast_forward(struct rte_mbuf **pkts, unsigned n)
+{
+	unsigned sent;
+
+	if (n == 0)
+		return;
+
+	sent = rte_eth_tx_burst(1, STEER_FAST_TXQ, pkts, n);
+	port_statistics[0].fastpath += sent;
+	if (unlikely(sent < n)) {
+		port_statistics[0].fastpath_dropped += n - sent;
+		pktmbuf_free_bulk(&pkts[sent], n - sent);
+	}
+}
+
+/* Apply loss and duplication to received packets, and pass them to the worker */
+static inline __attribute__((always_inline)) unsigned
+demu_rx_process_dp(unsigned portid, struct rte_mbuf **pkts_burst, unsigned nb_rx,
+		const unsigned features)
+{
+	struct rte_mbuf *rx2w_buffer[MAX_PKT_BURST * (DEMU_MAX_DUP_COPIES + 1)];
+	unsigned i, k;
+	unsigned nb_enq;
+	unsigned nb_copies;
+	uint32_t numenq;
+	uint64_t now, seq;
+#if DEMU_MBUF_DYN
+	struct demu_hwts_clock *clk = &hwts_clock[portid];
+#endif
+
+	if (likely(nb_rx == 0))
+		return 0;
+
+	PROFILE_BEGIN(begin);
+	seq = port_statistics[portid].rx;
+	port_statistics[portid].rx += nb_rx;
+
+	if (unlikely(link_down)) {
+		port_statistics[portid].discarded += nb_rx;
+		pktmbuf_free_bulk(pkts_burst, nb_rx);
+		return nb_rx;
+	}
+
+	now = demu_now();
+#if DEMU_MBUF_DYN
+	if (clk->enabled && unlikely(now >= clk->next_sync))
+		hwts_sync(portid, clk);
+#endif
+
+	nb_enq = 0;
+	for (i = 0; i < nb_rx; i++) {
+		struct rte_mbuf *pkt = pkts_burst[i];
+		struct rte_mbuf *clone;
+
+		if ((features & DP_RX_LOSS) && loss_event()) {
+			decision_record(DECISION_LOSS, seq + i, 1);
+			port_statistics[portid].discarded++;
+			rte_pktmbuf_free(pkt);
+			continue;
+		}
+
+		rte_prefetch0(rte_pktmbuf_mtod(pkt, void *));
+#if DEMU_MBUF_DYN
+		if (clk->enabled)
+			demu_set_tsc(pkt, hwts_to_tsc(clk, pkt, now));
+		else
+#endif
+			demu_set_tsc(pkt, now);
+		rx2w_buffer[nb_enq++] = pkt;
+
+		/*
+		 * rx2w_buffer has room for DEMU_MAX_DUP_COPIES copies of
+		 * every received packet, and dup_copies never exceeds it.
+		 * Each copy k is released dup_delay * k after the original.
+		 */
+		if (features & DP_RX_DUP) {
+			nb_copies = dup_event();
+			if (nb_copies)
+				decision_record(DECISION_DUP, seq + i, nb_copies);
+			for (k = 1; k <= nb_copies; k++) {
+				clone = rte_pktmbuf_clone(pkt, demu_clone_pool);
+				if (unlikely(clone == NULL)) {
+					port_statistics[portid].dup_dropped += nb_copies - k + 1;
+					break;
+				}
+				demu_set_tsc(clone, demu_get_tsc(pkt) + dup_delay * k);
+				rx2w_buffer[nb_enq++] = clone;
+				port_statistics[portid].duplicated++;
+			}
+		}
+
+#ifdef DEBUG_RX
+		if (rx_cnt < RX_STAT_BUF_SIZE) {
+			rx_stat[rx_cnt] = rte_rdtsc();
+			rx_cnt++;
+		}
+#endif
+
+	}
+
+	if (portid == 0 && arena_size)
+		numenq = arena_enqueue(&delay_arena, rx2w_buffer, nb_enq);
+	else if (portid == 0)
+		numenq = rte_ring_sp_enqueue_burst(rx_to_workers,
+				(void *)rx2w_buffer, nb_enq, NULL);
+	else
+		numenq = rte_ring_sp_enqueue_burst(rx_to_workers2,
+				(void *)rx2w_buffer, nb_enq, NULL);
+
+
+	if (unlikely(numenq < nb_enq)) {
+		port_statistics[portid].rx_worker_dropped += nb_enq - numenq;
+		pktmbuf_free_bulk(&rx2w_buffer[numenq], nb_enq - numenq);
+	}
+
+	PROFILE_END(DEMU_STAGE_IMPAIR, begin, nb_rx);
+	return nb_rx;
+}
+
+static unsigned
+demu_rx_process(unsigned portid, struct rte_mbuf **pkts_burst, unsigned nb_rx)
+{
+	return demu_rx_process_dp(portid, pkts_burst, nb_rx, rx_features[portid]);
+}
+
+static inline __attribute__((always_inline)) unsigned
+demu_rx_burst_dp(unsigned portid, const unsigned features)
+{
+	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
+	struct rte_mbuf *fast[MAX_PKT_BURST];
+	unsigned nb_rx, nb_fast, nb_impair, nb_xt = 0, nb_total = 0, i;
+	uint16_t burst = port_params[portid].rx_burst;
+	uint16_t q;
+
+	if (portid == 0 && xt_enabled)
+		nb_xt = xt_inject(rte_rdtsc());
+
+	if (portid != 0 || nb_impair_rules == 0) {
+		nb_rx = rte_eth_rx_burst((uint8_t) portid, 0, pkts_burst, burst);
+		return nb_xt + demu_rx_process_dp(portid, pkts_burst, nb_rx, features);
+	}
+
+	if (steer_hw) {
+		nb_fast = rte_eth_rx_burst(0, STEER_FAST_RXQ, fast, burst);
+		demu_fast_forward(fast, nb_fast);
+		nb_rx = rte_eth_rx_burst(0, STEER_IMPAIR_RXQ, pkts_burst, burst);
+		return nb_xt + nb_fast + demu_rx_process_dp(0, pkts_burst, nb_rx, features);
+	}
+
+	/*
+	 * Without the rte_flow rules the PMD still spreads the traffic over
+	 * all the configured queues (e.g., PACKET_FANOUT of af_packet), so
+	 * every queue is polled and classified.
+	 */
+	for (q = 0; q < steer_nb_rxq; q++) {
+		nb_rx = rte_eth_rx_burst(0, q, pkts_burst, burst);
+		nb_fast = 0;
+		nb_impair = 0;
 		for (i = 0; i < nb_rx; i++) {
-			struct rte_mbuf *clone;
+			if (impair_match(pkts_burst[i]))
+				pkts_burst[nb_impair++] = pkts_burst[i];
+			else
+				fast[nb_fast++] = pkts_burst[i];
+		}
+		demu_fast_forward(fast, nb_fast);
+		nb_total += nb_fast + demu_rx_process_dp(0, pkts_burst, nb_impair, features);
+	}
+
+	return nb_xt + nb_total;
+}
+
+static unsigned
+demu_rx_burst(unsigned portid)
+{
+	return demu_rx_burst_dp(portid, rx_features[portid]);
+}
+
+#define DEMU_RX_LOOP(features) \
+static void \
+demu_rx_loop_##features(unsigned portid) \
+{ \
+	while (!force_quit) \
+		PROFILE_STAGE(DEMU_STAGE_RX, portid, demu_rx_burst_dp(portid, features)); \
+}
+DEMU_RX_LOOP(0)
+DEMU_RX_LOOP(1)
+DEMU_RX_LOOP(2)
+DEMU_RX_LOOP(3)
+
+static void (* const demu_rx_loops[DP_RX_NB_VARIANTS])(unsigned) = {
+	demu_rx_loop_0, demu_rx_loop_1, demu_rx_loop_2, demu_rx_loop_3,
+};
+
+static void
+demu_rx_loop(unsigned portid)
+{
+	unsigned lcore_id;
+
+	lcore_id = rte_lcore_id();
+
+	RTE_LOG(INFO, DEMU, "Entering main rx loop on lcore %u portid %u features 0x%x\n",
+		lcore_id, portid, rx_features[portid]);
+
+	demu_rx_loops[rx_features[portid]](portid);
+}
+
+/*
+ * A worker keeps the burst dequeued from rx_to_workers across calls, and
+ * returns as soon as the packet at the head is not ready to be sent
+ * (i.e., it is still delayed, no token is left, or the TX ring is full).
+ */
+struct demu_worker_state {
+	unsigned portid;
+	uint16_t burst_size;
+	uint16_t i;
+	uint64_t next_depart;
+	struct rte_mbuf *burst_buffer[PKT_BURST_WORKER];
+};
+
+/*
+ * Fair queueing at the bottleneck (--fq).
+ * With the bandwidth limitation, packets whose delay has passed are put
+ * into one of FQ_NB_BUCKETS flow buckets by the hash of their addresses
+ * and ports, and sent by deficit round robin, so that an elephant flow
+ * does not starve the others. Packets are kept in a fixed array of slots
+ * linked per bucket, and the active buckets are linked in a FIFO, so both
+ * enqueue and dequeue are O(1). A packet is dropped when its bucket holds
+ * FQ_FLOW_LIMIT packets or all the --buffer-pkts slots are used.
+ */
+#define FQ_NB_BUCKETS 65536
+#define FQ_FLOW_LIMIT 1024
+#define FQ_DEFAULT_QUANTUM 1514
+#define FQ_NONE UINT32_MAX
+
+struct fq_bucket {
+	uint32_t head;  /* first slot */
+	uint32_t tail;  /* last slot */
+	uint32_t next;  /* next active bucket */
+	uint32_t qlen;
+	int32_t deficit;
+};
+
+struct demu_fq {
+	struct fq_bucket *buckets;
+	struct rte_mbuf **pkts;
+	uint32_t *next_slot;
+	uint32_t nb_slots;
+	uint32_t free_slot;
+	uint32_t active_head;
+	uint32_t active_tail;
+};
+
+static bool fq_enabled = false;
+static uint32_t fq_quantum = FQ_DEFAULT_QUANTUM;
+static struct demu_fq flow_queue;
+
+static int
+fq_init(struct demu_fq *fq)
+{
+	uint32_t i;
+
+	fq->buckets = rte_zmalloc("fq_buckets", sizeof(struct fq_bucket) * FQ_NB_BUCKETS,
+			RTE_CACHE_LINE_SIZE);
+	fq->nb_slots = delayed_buffer_pkts;
+	fq->pkts = rte_zmalloc("fq_pkts", sizeof(struct rte_mbuf *) * fq->nb_slots,
+			RTE_CACHE_LINE_SIZE);
+	fq->next_slot = rte_zmalloc("fq_next_slot", sizeof(uint32_t) * fq->nb_slots,
+			RTE_CACHE_LINE_SIZE);
+	if (fq->buckets == NULL || fq->pkts == NULL || fq->next_slot == NULL)
+		return -1;
+
+	for (i = 0; i < fq->nb_slots; i++)
+		fq->next_slot[i] = i + 1;
+	fq->next_slot[fq->nb_slots - 1] = FQ_NONE;
+	fq->free_slot = 0;
+	fq->active_head = FQ_NONE;
+	fq->active_tail = FQ_NONE;
+
+	return 0;
+}
+
+/* Hash of IPv4/IPv6 addresses, protocol and TCP/UDP ports, or of MAC addresses */
+static inline uint32_t
+fq_hash(struct rte_mbuf *m)
+{
+	const uint8_t *p = rte_pktmbuf_mtod(m, const uint8_t *);
+	uint32_t len = m->data_len;
+	uint32_t off = 12, l4 = 0, hash;
+	uint16_t type;
+	uint8_t proto;
+
+	if (unlikely(len < 14))
+		return 0;
+
+	type = (p[off] << 8) | p[off + 1];
+	if (type == 0x8100 && len >= 18) {
+		off += 4;
+		type = (p[off] << 8) | p[off + 1];
+	}
+	off += 2;
+
+	if (type == 0x0800 && len >= off + 20) {
+		proto = p[off + 9];
+		hash = rte_hash_crc(p + off + 12, 8, proto);
+		if (!(p[off + 6] & 0x3f) && !p[off + 7]) /* not a fragment */
+			l4 = off + (p[off] & 0xf) * 4;
+	} else if (type == 0x86dd && len >= off + 40) {
+		proto = p[off + 6];
+		hash = rte_hash_crc(p + off + 8, 32, proto);
+		l4 = off + 40;
+	} else
+		return rte_hash_crc(p, 12, 0);
+
+	if (l4 && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && len >= l4 + 4)
+		hash = rte_hash_crc(p + l4, 4, hash);
+
+	return hash;
+}
+
+static inline int
+fq_enqueue(struct demu_fq *fq, struct rte_mbuf *m)
+{
+	uint32_t idx = fq_hash(m) & (FQ_NB_BUCKETS - 1);
+	struct fq_bucket *b = &fq->buckets[idx];
+	uint32_t slot = fq->free_slot;
+
+	if (unlikely(slot == FQ_NONE || b->qlen >= FQ_FLOW_LIMIT))
+		return -1;
+
+	fq->free_slot = fq->next_slot[slot];
+	fq->pkts[slot] = m;
+	fq->next_slot[slot] = FQ_NONE;
+
+	if (b->qlen++ == 0) {
+		b->head = slot;
+		b->deficit = 0;
+		b->next = FQ_NONE;
+		if (fq->active_tail == FQ_NONE)
+			fq->active_head = idx;
+		else
+			fq->buckets[fq->active_tail].next = idx;
+		fq->active_tail = idx;
+	} else
+		fq->next_slot[b->tail] = slot;
+	b->tail = slot;
+
+	return 0;
+}
+
+/* Send up to nb_free packets by deficit round robin, subject to the bandwidth limitation */
+static unsigned
+fq_schedule(struct demu_fq *fq, uint64_t *next_depart, struct rte_ring *cring, unsigned nb_free)
+{
+	struct fq_bucket *b;
+	struct rte_mbuf *m, *w2t_buffer[PKT_BURST_WORKER];
+	uint64_t depart = 0;
+	uint32_t idx, slot;
+	unsigned nb_sent = 0;
+
+	nb_free = RTE_MIN(nb_free, PKT_BURST_WORKER);
+
+	while (nb_sent < nb_free && fq->active_head != FQ_NONE) {
+		idx = fq->active_head;
+		b = &fq->buckets[idx];
+
+		/* move the bucket to the tail of the round with a new quantum */
+		if (b->deficit <= 0) {
+			b->deficit += fq_quantum;
+			if (b->next != FQ_NONE) {
+				fq->active_head = b->next;
+				fq->buckets[fq->active_tail].next = idx;
+				fq->active_tail = idx;
+				b->next = FQ_NONE;
+			}
+			continue;
+		}
+
+		slot = b->head;
+		m = fq->pkts[slot];
+		if (!worker_shape(next_depart, demu_now(), m->pkt_len, &depart))
+			break;
+		if (tx_pacing)
+			demu_set_depart(m, depart);
+
+		b->head = fq->next_slot[slot];
+		fq->next_slot[slot] = fq->free_slot;
+		fq->free_slot = slot;
+		b->deficit -= m->pkt_len;
+
+		/* an empty bucket leaves the round */
+		if (--b->qlen == 0) {
+			fq->active_head = b->next;
+			if (fq->active_head == FQ_NONE)
+				fq->active_tail = FQ_NONE;
+		}
+
+		w2t_buffer[nb_sent++] = m;
+	}
+
+	return worker_enqueue(0, cring, w2t_buffer, nb_sent);
+}
+
+static inline bool
+worker_refill(struct demu_worker_state *ws)
+{
+	if (ws->i != ws->burst_size)
+		return true;
+
+	if (ws->portid == 0)
+		ws->burst_size = rte_ring_sc_dequeue_burst(rx_to_workers,
+				(void *)ws->burst_buffer, PKT_BURST_WORKER, NULL);
+	else
+		ws->burst_size = rte_ring_sc_dequeue_burst(rx_to_workers2,
+				(void *)ws->burst_buffer, PKT_BURST_WORKER, NULL);
+	ws->i = 0;
+
+	return ws->burst_size != 0;
+}
+
+/* Move delayed packets of port 0 into the flow buckets, and schedule them */
+static unsigned
+worker_fq_burst(struct demu_worker_state *ws)
+{
+	struct rte_mbuf *pkt;
+	unsigned nb_moved = 0;
+	uint64_t now;
+
+	if (worker_refill(ws)) {
+		now = demu_now();
+		while (ws->i != ws->burst_size) {
+			pkt = ws->burst_buffer[ws->i];
+			if (now - demu_get_tsc(pkt) < delayed_time)
+				break;
+
+			if (unlikely(fq_enqueue(&flow_queue, pkt) < 0)) {
+				port_statistics[0].queue_dropped++;
+				rte_pktmbuf_free(pkt);
+			}
+			ws->i++;
+			nb_moved++;
+		}
+	}
+
+	return nb_moved + fq_schedule(&flow_queue, &ws->next_depart, workers_to_tx2,
+			rte_ring_free_count(workers_to_tx2));
+}
+
+/*
+ * Multi-hop path (--hop).
+ * Packets from port 0 traverse a chain of virtual hops, each of which is
+ * a FIFO link with its own propagation delay, rate, queue and loss rate.
+ * Since every hop is FIFO, the time when a packet leaves the last hop is
+ * known when it enters the first one: the worker computes it for each
+ * packet in arrival order, keeping only the time each link becomes idle,
+ * and releases the packet at that time. A packet dropped at a hop does
+ * not occupy the link.
+ */
+#define MAX_HOPS 8
+#define CODEL_TARGET_US 5000
+#define CODEL_INTERVAL_US 100000
+#define CODEL_MTU 1514
+
+enum demu_hop_aqm {
+	HOP_AQM_DROPTAIL,
+	HOP_AQM_CODEL,
+};
+
+/* CoDel (RFC 8289), evaluated when a packet starts to be sent */
+struct demu_codel {
+	uint64_t first_above_time;
+	uint64_t drop_next;
+	uint32_t count;
+	uint32_t lastcount;
+	bool dropping;
+};
+
+struct demu_hop {
+	uint64_t delay_in_us;
+	uint64_t rate;          /* 0 for unlimited */
+	uint64_t queue_limit;   /* bytes, 0 for unlimited */
+	uint64_t loss;          /* in the unit of loss_random() */
+	enum demu_hop_aqm aqm;
+
+	uint64_t delay;
+	double cycles_per_byte;
+	uint64_t busy_until;    /* TSC when the link sends out the last packet */
+	struct demu_codel codel;
+
+	uint64_t lost;
+	uint64_t dropped;
+};
+
+static struct demu_hop hops[MAX_HOPS];
+static unsigned nb_hops = 0;
+static uint64_t codel_target;
+static uint64_t codel_interval;
+
+static bool
+codel_should_drop(struct demu_codel *c, uint64_t sojourn, uint64_t backlog, uint64_t now)
+{
+	bool ok_to_drop = false;
+
+	if (sojourn < codel_target || backlog <= CODEL_MTU)
+		c->first_above_time = 0;
+	else if (c->first_above_time == 0)
+		c->first_above_time = now + codel_interval;
+	else if (now >= c->first_above_time)
+		ok_to_drop = true;
+
+	if (c->dropping) {
+		if (!ok_to_drop) {
+			c->dropping = false;
+			return false;
+		}
+		if (now < c->drop_next)
+			return false;
+		c->count++;
+		c->drop_next += codel_interval / sqrt(c->count);
+		return true;
+	}
+
+	if (!ok_to_drop)
+		return false;
+
+	c->dropping = true;
+	if (c->count - c->lastcount > 1 && now - c->drop_next < 16 * codel_interval)
+		c->count = c->count - c->lastcount;
+	else
+		c->count = 1;
+	c->lastcount = c->count;
+	c->drop_next = now + codel_interval / sqrt(c->count);
+
+	return true;
+}
+
+/* Time when a packet arriving at t leaves the last hop, or 0 if it is dropped */
+static uint64_t
+hops_traverse(uint64_t t, uint32_t len)
+{
+	struct demu_hop *h;
+	uint64_t start, backlog;
+	unsigned n;
+
+	for (n = 0; n < nb_hops; n++) {
+		h = &hops[n];
+
+		if (h->loss && loss_event_random(h->loss)) {
+			decision_record(DECISION_HOP_LOSS, 0, n);
+			h->lost++;
+			port_statistics[0].hop_lost++;
+			return 0;
+		}
+
+		if (h->rate) {
+			start = RTE_MAX(t, h->busy_until);
+			backlog = (uint64_t)((start - t) / h->cycles_per_byte);
+			if ((h->queue_limit && backlog + len > h->queue_limit) ||
+					(h->aqm == HOP_AQM_CODEL &&
+					 codel_should_drop(&h->codel, start - t, backlog, start))) {
+				h->dropped++;
+				port_statistics[0].queue_dropped++;
+				return 0;
+			}
+			h->busy_until = start +
+				(uint64_t)((len + ETHER_WIRE_OVERHEAD) * h->cycles_per_byte);
+			t = h->busy_until;
+		}
+
+		t += h->delay;
+	}
+
+	return t;
+}
+
+/* Schedule a new burst through the hops, and remove the dropped packets */
+static uint16_t
+hops_schedule(struct rte_mbuf **pkts, uint16_t n)
+{
+	uint64_t depart;
+	uint16_t i, nb_kept = 0;
+
+	for (i = 0; i < n; i++) {
+		depart = hops_traverse(demu_get_tsc(pkts[i]) + delayed_time, pkts[i]->pkt_len);
+		if (depart == 0) {
+			rte_pktmbuf_free(pkts[i]);
+			continue;
+		}
+		demu_set_depart(pkts[i], depart);
+		pkts[nb_kept++] = pkts[i];
+	}
+
+	return nb_kept;
+}
+
+static unsigned
+worker_hops_burst(struct demu_worker_state *ws)
+{
+	struct rte_mbuf *pkt;
+	unsigned nb_free, nb_sent = 0;
+	uint64_t now;
+
+	if (ws->i == ws->burst_size) {
+		if (!worker_refill(ws))
+			return 0;
+		ws->burst_size = hops_schedule(ws->burst_buffer, ws->burst_size);
+	}
+
+	nb_free = rte_ring_free_count(workers_to_tx2);
+	now = demu_now();
+	while (ws->i != ws->burst_size && nb_sent < nb_free) {
+		pkt = ws->burst_buffer[ws->i];
+		if (now < demu_get_depart(pkt))
+			break;
+		ws->i++;
+		nb_sent++;
+	}
+
+	return worker_enqueue(0, workers_to_tx2, &ws->burst_buffer[ws->i - nb_sent], nb_sent);
+}
+
+/*
+ * Slotted delivery (--slot, --slot-trace).
+ * Wireless links send packets in aggregates at transmission opportunities
+ * (e.g., A-MPDU of Wi-Fi or TTI of LTE) instead of one by one. Packets
+ * from port 0 whose delay has passed wait for the next opportunity, which
+ * releases them at once up to its byte budget. The opportunities repeat
+ * every cycle, either one per period or as listed in a trace in the
+ * format of Mahimahi: each line is the time [ms] when MTU-sized bytes can
+ * be delivered, and the trace loops at the last time. An opportunity can
+ * only carry packets whose delay had passed at its time, and the first
+ * packet of an aggregate is sent even if it exceeds the budget.
+ */
+#define SLOT_MAX_OPPORTUNITIES 65536
+#define SLOT_TRACE_BYTES 1500
+
+struct demu_slot_opportunity {
+	uint64_t offset;        /* TSC from the start of the cycle */
+	uint32_t bytes;
+};
+
+struct demu_slots {
+	struct demu_slot_opportunity *opp;
+	unsigned nb_opp;
+	uint64_t cycle;
+	uint64_t period_in_us;  /* --slot */
+	uint32_t bytes;
+	const char *trace_file; /* --slot-trace */
+
+	unsigned index;
+	uint64_t cycle_start;
+	uint64_t next;          /* TSC of the current opportunity */
+	uint32_t left;          /* bytes left in the current opportunity */
+
+	uint64_t aggregates;
+};
+
+static bool slot_enabled = false;
+static struct demu_slots slots;
+
+static int
+slot_load_trace(struct demu_slots *s)
+{
+	FILE *fp;
+	unsigned long ms, last = 0;
+	uint64_t tsc_per_ms = rte_get_tsc_hz() / MS_PER_S;
+
+	fp = fopen(s->trace_file, "r");
+	if (fp == NULL) {
+		RTE_LOG(ERR, DEMU, "Cannot open %s: %s\n", s->trace_file, strerror(errno));
+		return -1;
+	}
+	while (fscanf(fp, "%lu", &ms) == 1) {
+		if (ms < last) {
+			RTE_LOG(ERR, DEMU, "Time goes back in %s: %lu\n", s->trace_file, ms);
+			fclose(fp);
+			return -1;
+		}
+		/* the lines of the same time form one opportunity */
+		if (s->nb_opp && ms == last)
+			s->opp[s->nb_opp - 1].bytes += SLOT_TRACE_BYTES;
+		else if (s->nb_opp < SLOT_MAX_OPPORTUNITIES) {
+			s->opp[s->nb_opp].offset = tsc_per_ms * ms;
+			s->opp[s->nb_opp].bytes = SLOT_TRACE_BYTES;
+			s->nb_opp++;
+		} else {
+			RTE_LOG(ERR, DEMU, "More than %d opportunities in %s\n",
+				SLOT_MAX_OPPORTUNITIES, s->trace_file);
+			fclose(fp);
+			return -1;
+		}
+		last = ms;
+	}
+	if (!feof(fp)) {
+		RTE_LOG(ERR, DEMU, "Invalid line in %s after %lu ms\n", s->trace_file, last);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	if (s->nb_opp == 0 || last == 0) {
+		RTE_LOG(ERR, DEMU, "No cycle in %s\n", s->trace_file);
+		return -1;
+	}
+	s->cycle = tsc_per_ms * last;
+
+	return 0;
+}
+
+static int
+slot_init(struct demu_slots *s)
+{
+	s->opp = rte_malloc("slots", sizeof(struct demu_slot_opportunity) * SLOT_MAX_OPPORTUNITIES, 0);
+	if (s->opp == NULL)
+		return -1;
+
+	if (s->trace_file) {
+		if (slot_load_trace(s) < 0)
+			return -1;
+	} else {
+		s->opp[0].offset = 0;
+		s->opp[0].bytes = s->bytes;
+		s->nb_opp = 1;
+		s->cycle = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * s->period_in_us;
+	}
+
+	return 0;
+}
+
+static void
+slot_start(struct demu_slots *s, uint64_t now)
+{
+	s->index = 0;
+	s->cycle_start = now;
+	s->next = now + s->opp[0].offset;
+	s->left = s->opp[0].bytes;
+}
+
+static inline void
+slot_next(struct demu_slots *s)
+{
+	if (++s->index == s->nb_opp) {
+		s->index = 0;
+		s->cycle_start += s->cycle;
+	}
+	s->next = s->cycle_start + s->opp[s->index].offset;
+	s->left = s->opp[s->index].bytes;
+}
+
+/* Skip the opportunities before t, which have nothing to carry */
+static void
+slot_skip(struct demu_slots *s, uint64_t t)
+{
+	if (s->next >= t)
+		return;
+
+	if (t - s->cycle_start >= s->cycle) {
+		s->cycle_start += (t - s->cycle_start) / s->cycle * s->cycle;
+		s->index = 0;
+		s->next = s->cycle_start + s->opp[0].offset;
+		s->left = s->opp[0].bytes;
+	}
+	while (s->next < t)
+		slot_next(s);
+}
+
+static unsigned
+worker_slot_burst(struct demu_worker_state *ws)
+{
+	struct demu_slots *s = &slots;
+	struct rte_mbuf *pkt, *w2t_buffer[DEMU_SEND_BUFFER_SIZE_PKTS];
+	unsigned nb_free, nb_sent = 0;
+	uint64_t now, ready;
+
+	now = demu_now();
+	if (!worker_refill(ws)) {
+		/* the opportunities pass with nothing to carry */
+		slot_skip(s, now + 1);
+		return 0;
+	}
+	if (s->next > now)
+		return 0;
+
+	nb_free = rte_ring_free_count(workers_to_tx2);
+	while (s->next <= now && nb_sent < nb_free) {
+		if (!worker_refill(ws)) {
+			slot_skip(s, now + 1);
+			break;
+		}
+
+		pkt = ws->burst_buffer[ws->i];
+		ready = demu_get_tsc(pkt) + delayed_time;
+		if (ready > s->next) {
+			slot_skip(s, ready);
+			continue;
+		}
+
+		/* the first packet opens an aggregate, and one that does not fit closes it */
+		if (s->left == s->opp[s->index].bytes)
+			s->aggregates++;
+		else if (pkt->pkt_len > s->left) {
+			slot_next(s);
+			continue;
+		}
+
+		s->left -= RTE_MIN(pkt->pkt_len, s->left);
+		w2t_buffer[nb_sent++] = pkt;
+		ws->i++;
+	}
+
+	return worker_enqueue(0, workers_to_tx2, w2t_buffer, nb_sent);
+}
+
+/*
+ * VLAN-multiplexed links (--vlan-link).
+ * Each VLAN ID given to --vlan-link is a virtual link of its own from
+ * port 0 to port 1, with its delay, rate, queue and loss rate, so that a
+ * single pair of ports can emulate a link per VM. The worker of port 0
+ * puts each packet into the FIFO of its link, computing the departure
+ * time as a hop does, and releases the heads of the active links whose
+ * time has come. Untagged packets and other VLANs share the default link,
+ * which has the delay of -d. The parameters and the state of a link fit
+ * in a cache line, and the packets are kept in a slot array shared by all
+ * the links, so the memory does not grow with the number of links. The
+ * slots take the place of rx_to_workers, so there are as many of them as
+ * --buffer-pkts.
+ */
+#define VLAN_LINK_MAX_RULES 64
+#define VLAN_LINK_DEFAULT 0
+#define VLAN_NONE UINT32_MAX
+#define VLAN_ID_MAX 4096
+
+struct demu_vlan_link_rule {
+	uint16_t vid_first;
+	uint16_t vid_last;
+	uint64_t delay_in_us;
+	uint64_t rate;          /* 0 for unlimited */
+	uint64_t queue_limit;   /* bytes, 0 for unlimited */
+	uint64_t loss;          /* in the unit of loss_random() */
+};
+
+struct demu_vlan_link {
+	uint64_t delay;
+	double cycles_per_byte; /* 0 for unlimited */
+	uint64_t queue_limit;
+	uint64_t busy_until;
+	uint32_t loss;
+	uint32_t head;          /* first slot */
+	uint32_t tail;          /* last slot */
+	uint32_t next_active;
+} __rte_cache_aligned;
+
+struct demu_vlan_link_stats {
+	uint16_t vid;           /* 0 for the default link */
+	uint64_t pkts;
+	uint64_t lost;
+	uint64_t dropped;
+};
+
+struct demu_vlan_links {
+	struct demu_vlan_link *link;
+	struct demu_vlan_link_stats *stats;
+	uint16_t link_of[VLAN_ID_MAX];
+	unsigned nb_links;      /* including the default link */
+	struct rte_mbuf **pkts;
+	uint32_t *next_slot;
+	uint32_t nb_slots;
+	uint32_t free_slot;
+	uint32_t active_head;
+	uint32_t active_tail;
+};
+
+static struct demu_vlan_link_rule vlan_link_rules[VLAN_LINK_MAX_RULES];
+static unsigned nb_vlan_link_rules = 0;
+static struct demu_vlan_links vlan_links;
+
+static int
+vlan_links_init(struct demu_vlan_links *vl)
+{
+	const struct demu_vlan_link_rule *r;
+	uint64_t tsc_per_us = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S;
+	unsigned n, vid, idx;
+
+	vl->nb_links = 1;
+	for (n = 0; n < nb_vlan_link_rules; n++)
+		vl->nb_links += vlan_link_rules[n].vid_last - vlan_link_rules[n].vid_first + 1;
+
+	vl->link = rte_zmalloc("vlan_links", sizeof(struct demu_vlan_link) * vl->nb_links,
+			RTE_CACHE_LINE_SIZE);
+	vl->stats = rte_zmalloc("vlan_link_stats",
+			sizeof(struct demu_vlan_link_stats) * vl->nb_links, RTE_CACHE_LINE_SIZE);
+	vl->nb_slots = delayed_buffer_pkts;
+	vl->pkts = rte_zmalloc("vlan_link_pkts", sizeof(struct rte_mbuf *) * vl->nb_slots,
+			RTE_CACHE_LINE_SIZE);
+	vl->next_slot = rte_zmalloc("vlan_link_next_slot", sizeof(uint32_t) * vl->nb_slots,
+			RTE_CACHE_LINE_SIZE);
+	if (vl->link == NULL || vl->stats == NULL || vl->pkts == NULL || vl->next_slot == NULL)
+		return -1;
+
+	for (n = 0; n < vl->nb_slots; n++)
+		vl->next_slot[n] = n + 1;
+	vl->next_slot[vl->nb_slots - 1] = VLAN_NONE;
+	vl->free_slot = 0;
+	vl->active_head = VLAN_NONE;
+	vl->active_tail = VLAN_NONE;
+
+	for (n = 0; n < vl->nb_links; n++) {
+		vl->link[n].head = VLAN_NONE;
+		vl->link[n].tail = VLAN_NONE;
+		vl->link[n].next_active = VLAN_NONE;
+	}
+	for (vid = 0; vid < VLAN_ID_MAX; vid++)
+		vl->link_of[vid] = VLAN_LINK_DEFAULT;
+
+	idx = 1;
+	for (n = 0; n < nb_vlan_link_rules; n++) {
+		r = &vlan_link_rules[n];
+		for (vid = r->vid_first; vid <= r->vid_last; vid++, idx++) {
+			vl->link_of[vid] = idx;
+			vl->stats[idx].vid = vid;
+			vl->link[idx].delay = tsc_per_us * r->delay_in_us;
+			if (r->rate)
+				vl->link[idx].cycles_per_byte = (double)rte_get_tsc_hz() * 8 / r->rate;
+			vl->link[idx].queue_limit = r->queue_limit;
+			vl->link[idx].loss = r->loss;
+		}
+	}
+
+	return 0;
+}
+
+/* Link of the VLAN tag in the packet, as the ports do not strip it */
+static inline unsigned
+vlan_link_classify(const struct demu_vlan_links *vl, struct rte_mbuf *m)
+{
+	const uint8_t *p = rte_pktmbuf_mtod(m, const uint8_t *);
+
+	if (m->data_len < 18 || ((p[12] << 8) | p[13]) != 0x8100)
+		return VLAN_LINK_DEFAULT;
+
+	return vl->link_of[((p[14] << 8) | p[15]) & (VLAN_ID_MAX - 1)];
+}
+
+/* Put a packet into the FIFO of its link, or drop it */
+static void
+vlan_link_enqueue(struct demu_vlan_links *vl, struct rte_mbuf *m)
+{
+	unsigned idx = vlan_link_classify(vl, m);
+	struct demu_vlan_link *l = &vl->link[idx];
+	uint64_t t = demu_get_tsc(m), start, backlog;
+	uint32_t slot;
+
+	vl->stats[idx].pkts++;
+
+	if (l->loss && loss_event_random(l->loss)) {
+		decision_record(DECISION_LINK_LOSS, 0, vl->stats[idx].vid);
+		vl->stats[idx].lost++;
+		port_statistics[0].link_lost++;
+		rte_pktmbuf_free(m);
+		return;
+	}
+
+	slot = vl->free_slot;
+	if (unlikely(slot == VLAN_NONE))
+		goto drop;
+
+	if (l->cycles_per_byte) {
+		start = RTE_MAX(t, l->busy_until);
+		backlog = (uint64_t)((start - t) / l->cycles_per_byte);
+		if (l->queue_limit && backlog + m->pkt_len > l->queue_limit)
+			goto drop;
+		l->busy_until = start +
+			(uint64_t)((m->pkt_len + ETHER_WIRE_OVERHEAD) * l->cycles_per_byte);
+		t = l->busy_until;
+	}
+
+	/* the default link follows -d, which a scenario may change */
+	demu_set_depart(m, t + (idx == VLAN_LINK_DEFAULT ? delayed_time : l->delay));
+
+	vl->free_slot = vl->next_slot[slot];
+	vl->pkts[slot] = m;
+	vl->next_slot[slot] = VLAN_NONE;
+	if (l->head == VLAN_NONE) {
+		l->head = slot;
+		if (vl->active_tail == VLAN_NONE)
+			vl->active_head = idx;
+		else
+			vl->link[vl->active_tail].next_active = idx;
+		vl->active_tail = idx;
+	} else
+		vl->next_slot[l->tail] = slot;
+	l->tail = slot;
+	return;
+
+drop:
+	vl->stats[idx].dropped++;
+	port_statistics[0].queue_dropped++;
+	rte_pktmbuf_free(m);
+}
+
+/* Send the heads of the active links whose time has come, in round robin */
+static unsigned
+vlan_link_schedule(struct demu_vlan_links *vl, uint64_t now, unsigned nb_free)
+{
+	struct rte_mbuf *m, *w2t_buffer[DEMU_SEND_BUFFER_SIZE_PKTS];
+	struct demu_vlan_link *l;
+	uint32_t idx, next, prev = VLAN_NONE, slot;
+	unsigned nb_sent = 0;
+
+	nb_free = RTE_MIN(nb_free, DEMU_SEND_BUFFER_SIZE_PKTS);
+
+	idx = vl->active_head;
+	while (idx != VLAN_NONE && nb_sent < nb_free) {
+		l = &vl->link[idx];
+		while (l->head != VLAN_NONE && nb_sent < nb_free) {
+			slot = l->head;
+			m = vl->pkts[slot];
+			if (demu_get_depart(m) > now)
+				break;
+			l->head = vl->next_slot[slot];
+			vl->next_slot[slot] = vl->free_slot;
+			vl->free_slot = slot;
+			w2t_buffer[nb_sent++] = m;
+		}
+
+		next = l->next_active;
+		if (l->head == VLAN_NONE) {
+			/* an empty link leaves the active list */
+			l->tail = VLAN_NONE;
+			l->next_active = VLAN_NONE;
+			if (prev == VLAN_NONE)
+				vl->active_head = next;
+			else
+				vl->link[prev].next_active = next;
+			if (vl->active_tail == idx)
+				vl->active_tail = prev;
+		} else
+			prev = idx;
+		idx = next;
+	}
+
+	/* the next round starts from the first link not visited */
+	if (idx != VLAN_NONE && prev != VLAN_NONE) {
+		vl->link[vl->active_tail].next_active = vl->active_head;
+		vl->active_head = idx;
+		vl->link[prev].next_active = VLAN_NONE;
+		vl->active_tail = prev;
+	}
+
+	return worker_enqueue(0, workers_to_tx2, w2t_buffer, nb_sent);
+}
+
+static unsigned
+worker_vlan_burst(struct demu_worker_state *ws)
+{
+	unsigned nb_moved = 0;
+
+	if (worker_refill(ws)) {
+		while (ws->i != ws->burst_size) {
+			vlan_link_enqueue(&vlan_links, ws->burst_buffer[ws->i++]);
+			nb_moved++;
+		}
+	}
+
+	if (vlan_links.active_head == VLAN_NONE)
+		return nb_moved;
+
+	return nb_moved + vlan_link_schedule(&vlan_links, demu_now(),
+			rte_ring_free_count(workers_to_tx2));
+}
+
+/* The earliest departure time of the heads of the links */
+static uint64_t
+vlan_link_next_depart(const struct demu_vlan_links *vl)
+{
+	uint64_t t = UINT64_MAX;
+	uint32_t idx;
+
+	for (idx = vl->active_head; idx != VLAN_NONE; idx = vl->link[idx].next_active)
+		t = RTE_MIN(t, demu_get_depart(vl->pkts[vl->link[idx].head]));
+
+	return t;
+}
+
+static inline __attribute__((always_inline)) unsigned
+worker_burst_dp(struct demu_worker_state *ws, const unsigned features)
+{
+	struct rte_mbuf *pkt;
+	struct rte_ring *cring;
+	uint64_t now, diff_tsc, depart = 0;
+	unsigned nb_free;
+	unsigned nb_sent = 0;
+	struct rte_mbuf **w2t_buffer;
+
+	if (ws->portid == 0 && arena_size)
+		return arena_dequeue(&delay_arena, &ws->next_depart, workers_to_tx2);
+
+	if (ws->portid == 0 && fq_enabled)
+		return worker_fq_burst(ws);
+
+	if (ws->portid == 0 && nb_hops)
+		return worker_hops_burst(ws);
+
+	if (ws->portid == 0 && slot_enabled)
+		return worker_slot_burst(ws);
+
+	if (ws->portid == 0 && nb_vlan_link_rules)
+		return worker_vlan_burst(ws);
+
+	if (unlikely(!worker_refill(ws)))
+		return 0;
+
+	if (ws->portid == 0)
+		cring = workers_to_tx2;
+	else
+		cring = workers_to_tx;
+
+	/* this worker is the only producer, so free entries never decrease */
+	nb_free = rte_ring_free_count(cring);
+
+	while (ws->i != ws->burst_size && nb_sent < nb_free) {
+		pkt = ws->burst_buffer[ws->i];
+
+		/* Add a given delay when a packet comes from the port 0.
+		 * FIXME: fix this implementation.
+		 */
+		if (features & DP_W_DELAY) {
+
+			rte_prefetch0(rte_pktmbuf_mtod(pkt, void *));
+			now = demu_now();
+			diff_tsc = now - demu_get_tsc(pkt);
+			if (diff_tsc < delayed_time)
+				break;
+
+			if ((features & DP_W_SHAPE) &&
+					!worker_shape(&ws->next_depart, now, pkt->pkt_len, &depart))
+				break;
+			if (features & DP_W_PACED)
+				demu_set_depart(pkt, depart);
+		}
+
+		ws->i++;
+		nb_sent++;
+	}
+
+	/* the packets to send are contiguous in the burst buffer */
+	w2t_buffer = &ws->burst_buffer[ws->i - nb_sent];
+	return worker_enqueue(ws->portid, cring, w2t_buffer, nb_sent);
+}
+
+static unsigned
+worker_burst(struct demu_worker_state *ws)
+{
+	return worker_burst_dp(ws, worker_features[ws->portid]);
+}
+
+#define DEMU_WORKER_LOOP(features) \
+static void \
+worker_loop_##features(struct demu_worker_state *ws) \
+{ \
+	while (!force_quit) \
+		PROFILE_STAGE(DEMU_STAGE_WORKER, ws->portid, worker_burst_dp(ws, features)); \
+}
+DEMU_WORKER_LOOP(0)
+DEMU_WORKER_LOOP(1)
+DEMU_WORKER_LOOP(2)
+DEMU_WORKER_LOOP(3)
+DEMU_WORKER_LOOP(4)
+DEMU_WORKER_LOOP(5)
+DEMU_WORKER_LOOP(6)
+DEMU_WORKER_LOOP(7)
+
+static void (* const worker_loops[DP_W_NB_VARIANTS])(struct demu_worker_state *) = {
+	worker_loop_0, worker_loop_1, worker_loop_2, worker_loop_3,
+	worker_loop_4, worker_loop_5, worker_loop_6, worker_loop_7,
+};
+
+/* The time when the worker of port 0 can release the next packet */
+static uint64_t
+offline_next_release(const struct demu_worker_state *ws)
+{
+	uint64_t t = UINT64_MAX, paced = 0;
+	struct rte_mbuf *head;
+
+	/* worker_shape() schedules at most pacing_horizon ahead */
+	if (tx_pacing && ws->next_depart > pacing_horizon)
+		paced = ws->next_depart - pacing_horizon;
+
+	if (nb_vlan_link_rules)
+		return ws->i != ws->burst_size || rte_ring_count(rx_to_workers) ?
+			virtual_tsc : vlan_link_next_depart(&vlan_links);
+
+	if (ws->i != ws->burst_size) {
+		head = ws->burst_buffer[ws->i];
+		if (nb_hops)
+			return demu_get_depart(head);
+		t = demu_get_tsc(head) + delayed_time;
+		if (slot_enabled)
+			return RTE_MAX(t, slots.next);
+		/* without fq, the head is also shaped */
+		if (!fq_enabled)
+			t = RTE_MAX(t, paced);
+	} else if (rte_ring_count(rx_to_workers))
+		return virtual_tsc;
+
+	if (fq_enabled && flow_queue.active_head != FQ_NONE)
+		t = RTE_MIN(t, RTE_MAX(virtual_tsc, paced));
+
+	return t;
+}
 
-			if (portid == 0 && loss_event()) {
-				port_statistics[portid].discarded++;
-				nb_loss++;
-				continue;
-			}
+static int
+demu_offline_run(void)
+{
+	struct demu_worker_state ws = { .portid = 0 };
+	static uint8_t buf[PCAP_SNAPLEN];
+	struct rte_mbuf *m;
+	uint64_t ts_ns, arrival = 0, next, jitter_next;
+	unsigned n;
+	int len, ret = 0;
+	bool full = false;
+
+	if (pcap_open() < 0)
+		return -1;
 
-			rx2w_buffer[i - nb_loss + nb_dup] = pkts_burst[i];
-			rte_prefetch0(rte_pktmbuf_mtod(rx2w_buffer[i - nb_loss + nb_dup], void *));
-			rx2w_buffer[i - nb_loss + nb_dup]->udata64 = rte_rdtsc();
-
-			/* FIXME: we do not check the buffer overrun of rx2w_buffer. */
-			if (portid == 0 && dup_event()) {
-				clone = rte_pktmbuf_clone(rx2w_buffer[i - nb_loss + nb_dup], demu_pktmbuf_pool);
-				if (clone == NULL)
-					RTE_LOG(ERR, DEMU, "cannot clone a packet\n");
-				nb_dup++;
-				rx2w_buffer[i - nb_loss + nb_dup] = clone;
-			}
+	offline_io.base_tsc = rte_get_tsc_hz();
+	virtual_tsc = offline_io.base_tsc;
+	demu_stats->start_tsc = virtual_tsc;
+	if (slot_enabled)
+		slot_start(&slots, virtual_tsc);
+	jitter_next = virtual_tsc + rte_get_tsc_hz();
+	cross_traffic.next = virtual_tsc;
+
+	len = pcap_read(buf, &ts_ns);
+	if (len >= 0) {
+		offline_io.first_ns = ts_ns;
+		arrival = offline_ns_to_tsc(ts_ns);
+	}
 
-#ifdef DEBUG_RX
-			if (rx_cnt < RX_STAT_BUF_SIZE) {
-				rx_stat[rx_cnt] = rte_rdtsc();
-				rx_cnt++;
+	while (!force_quit) {
+		/* packets arriving now */
+		while (len >= 0 && arrival <= virtual_tsc) {
+			offline_io.read++;
+			m = rte_pktmbuf_alloc(demu_pktmbuf_pool);
+			if (unlikely(m == NULL)) {
+				full = true;
+				break;
+			}
+			if (unlikely((unsigned)len > rte_pktmbuf_tailroom(m))) {
+				offline_io.too_long++;
+				rte_pktmbuf_free(m);
+			} else {
+				rte_memcpy(rte_pktmbuf_mtod(m, void *), buf, len);
+				m->data_len = len;
+				m->pkt_len = len;
+				demu_rx_process(0, &m, 1);
 			}
-#endif
 
+			len = pcap_read(buf, &ts_ns);
+			if (len >= 0)
+				arrival = RTE_MAX(arrival, offline_ns_to_tsc(RTE_MAX(ts_ns, offline_io.first_ns)));
 		}
 
-		if (portid == 0)
-			numenq = rte_ring_sp_enqueue_burst(rx_to_workers,
-					(void *)rx2w_buffer, nb_rx - nb_loss + nb_dup, NULL);
-		else
-			numenq = rte_ring_sp_enqueue_burst(rx_to_workers2,
-					(void *)rx2w_buffer, nb_rx - nb_loss + nb_dup, NULL);
-
+		if (unlikely(full || port_statistics[0].rx_worker_dropped)) {
+			RTE_LOG(ERR, DEMU, "Offline: more than %u packets in flight after %lu packets,"
+				" increase --buffer-pkts\n", delayed_buffer_pkts, offline_io.read);
+			ret = -1;
+			break;
+		}
 
-		if (unlikely(numenq < (unsigned)(nb_rx - nb_loss + nb_dup))) {
-			RTE_LOG(WARNING, DEMU, "Delayed Queue Overflow count: %d\n",
-				(nb_rx - nb_loss + nb_dup) - numenq);
-			pktmbuf_free_bulk(&pkts_burst[numenq], nb_rx - nb_loss + nb_dup - numenq);
+		if (delayed_jitter && virtual_tsc >= jitter_next) {
+			delay_timer_cb(NULL, NULL);
+			jitter_next += rte_get_tsc_hz();
+		}
+		if (xt_enabled && len >= 0)
+			xt_inject(virtual_tsc);
+
+		do {
+			n = worker_burst(&ws);
+			n += demu_tx_burst(1);
+		} while (n);
+
+		/* move to the next event */
+		next = offline_next_release(&ws);
+		if (len >= 0) {
+			next = RTE_MIN(next, arrival);
+			if (xt_enabled)
+				next = RTE_MIN(next, cross_traffic.next);
 		}
+		if (next == UINT64_MAX)
+			break;
+		if (delayed_jitter)
+			next = RTE_MIN(next, jitter_next);
+		virtual_tsc = RTE_MAX(next, virtual_tsc + 1);
+	}
+
+	fclose(offline_io.in);
+	fclose(offline_io.out);
+
+	RTE_LOG(INFO, DEMU, "Offline: read: %lu written: %lu discarded: %lu duplicated: %lu"
+		" dropped: %lu too long: %lu\n",
+		offline_io.read, offline_io.written,
+		port_statistics[0].discarded + port_statistics[0].hop_lost +
+		port_statistics[0].link_lost,
+		port_statistics[0].duplicated,
+		port_statistics[0].rx_worker_dropped + port_statistics[0].queue_dropped +
+		port_statistics[0].worker_tx_dropped + port_statistics[1].dropped,
+		offline_io.too_long);
+	if (latency_probe) {
+		const struct demu_latency_hist *h = &demu_stats->latency[1];
+		double us_per_tsc = (double)US_PER_S / rte_get_tsc_hz();
+
+		RTE_LOG(INFO, DEMU, "Offline: residence time [us]: p50: %.1f p99: %.1f max: %.1f\n",
+			demu_hist_quantile(h, 0.5) * us_per_tsc,
+			demu_hist_quantile(h, 0.99) * us_per_tsc, h->max * us_per_tsc);
 	}
+
+	return force_quit ? -1 : ret;
 }
 
 static void
 worker_thread(unsigned portid)
 {
-	uint16_t burst_size = 0;
-	struct rte_mbuf *burst_buffer[PKT_BURST_WORKER];
-	uint64_t diff_tsc;
-	int i;
+	struct demu_worker_state ws = { .portid = portid };
+	unsigned lcore_id;
+
+	lcore_id = rte_lcore_id();
+	RTE_LOG(INFO, DEMU, "Entering main worker on lcore %u portid %u features 0x%x\n",
+		lcore_id, portid, worker_features[portid]);
+
+	worker_loops[worker_features[portid]](&ws);
+}
+
+/*
+ * Run-to-completion mode (--rtc-cores).
+ * One lcore runs RX, worker and TX of a direction in turn, either for both
+ * directions on the main lcore (1 core), or one direction per lcore on the
+ * main lcore and the next one (2 cores). The timers are managed in the same
+ * loop, so no timer core is needed.
+ * When an lcore is idle, it first waits with pause (or umwait where the CPU
+ * supports it), and if --idle-sleep is given and no packet is in flight, it
+ * sleeps to give the core back to other processes.
+ */
+#define RTC_DIR_0TO1 0x1
+#define RTC_DIR_1TO0 0x2
+#define IDLE_PAUSE_POLLS 64
+#define IDLE_SLEEP_POLLS 1024
+#define IDLE_UMWAIT_US 1
+
+static uint64_t idle_sleep_us = 0;
+#if DPDK_VERSION >= 21
+static bool idle_umwait = false;
+#endif
+
+static bool
+demu_rtc_pending(const struct demu_worker_state *ws, unsigned dir_mask)
+{
+	if ((dir_mask & RTC_DIR_0TO1) && (ws[0].i != ws[0].burst_size ||
+			delay_arena.head != delay_arena.tail ||
+			(fq_enabled && flow_queue.active_head != FQ_NONE) ||
+			(nb_vlan_link_rules && vlan_links.active_head != VLAN_NONE) ||
+			tx_state[1].i != tx_state[1].n ||
+			rte_ring_count(rx_to_workers) || rte_ring_count(workers_to_tx2)))
+		return true;
+	if ((dir_mask & RTC_DIR_1TO0) && (ws[1].i != ws[1].burst_size ||
+			tx_state[0].i != tx_state[0].n ||
+			rte_ring_count(rx_to_workers2) || rte_ring_count(workers_to_tx)))
+		return true;
+
+	return false;
+}
+
+static void
+demu_rtc_idle(unsigned idle_polls, const struct demu_worker_state *ws, unsigned dir_mask)
+{
+	if (idle_polls < IDLE_PAUSE_POLLS)
+		return;
+
+	if (idle_sleep_us && idle_polls >= IDLE_SLEEP_POLLS && !demu_rtc_pending(ws, dir_mask)) {
+#if DPDK_VERSION >= 18
+		rte_delay_us_sleep(idle_sleep_us);
+#else
+		usleep(idle_sleep_us);
+#endif
+		return;
+	}
+
+#if DPDK_VERSION >= 21
+	if (idle_umwait) {
+		rte_power_pause(rte_rdtsc() + rte_get_tsc_hz() / US_PER_S * IDLE_UMWAIT_US);
+		return;
+	}
+#endif
+	rte_pause();
+}
+
+static void
+demu_rtc_loop(unsigned dir_mask)
+{
+	struct demu_worker_state ws[2] = {
+		{ .portid = 0 },
+		{ .portid = 1 },
+	};
 	unsigned lcore_id;
-	int status;
+	unsigned nb_work;
+	unsigned idle_polls = 0;
+	bool timer = false;
+	bool refill = false;
 
 	lcore_id = rte_lcore_id();
-	RTE_LOG(INFO, DEMU, "Entering main worker on lcore %u\n", lcore_id);
+
+	RTE_LOG(INFO, DEMU, "Entering run-to-completion loop on lcore %u%s%s\n", lcore_id,
+		(dir_mask & RTC_DIR_0TO1) ? " port 0->1" : "",
+		(dir_mask & RTC_DIR_1TO0) ? " port 1->0" : "");
+
+	if (dir_mask & RTC_DIR_0TO1) {
+		timer = demu_timer_init(lcore_id, true);
+		refill = (limit_speed || scenario_has_rate) && !tx_pacing;
+	}
 
 	while (!force_quit) {
-		if (portid == 0)
-			burst_size = rte_ring_sc_dequeue_burst(rx_to_workers,
-					(void *)burst_buffer, PKT_BURST_WORKER, NULL);
-		else
-			burst_size = rte_ring_sc_dequeue_burst(rx_to_workers2,
-					(void *)burst_buffer, PKT_BURST_WORKER, NULL);
-		if (unlikely(burst_size == 0))
+		nb_work = 0;
+
+		if (refill)
+			tx_token_refill(rte_rdtsc());
+
+		if (dir_mask & RTC_DIR_0TO1) {
+			nb_work += PROFILE_STAGE(DEMU_STAGE_RX, 0, demu_rx_burst(0));
+			nb_work += PROFILE_STAGE(DEMU_STAGE_WORKER, 0, worker_burst(&ws[0]));
+			nb_work += PROFILE_STAGE(DEMU_STAGE_TX, 1, demu_tx_burst(1));
+		}
+
+		if (dir_mask & RTC_DIR_1TO0) {
+			nb_work += PROFILE_STAGE(DEMU_STAGE_RX, 1, demu_rx_burst(1));
+			nb_work += PROFILE_STAGE(DEMU_STAGE_WORKER, 1, worker_burst(&ws[1]));
+			nb_work += PROFILE_STAGE(DEMU_STAGE_TX, 0, demu_tx_burst(0));
+		}
+
+		if (timer)
+			rte_timer_manage();
+
+		if (nb_work) {
+			idle_polls = 0;
 			continue;
+		}
 
-		i = 0;
-		while (i != burst_size) {
-			/* Add a given delay when a packet comes from the port 0.
-			 * FIXME: fix this implementation.
-			 */
-			if (portid == 0) {
-
-				rte_prefetch0(rte_pktmbuf_mtod(burst_buffer[i], void *));
-				diff_tsc = rte_rdtsc() - burst_buffer[i]->udata64;
-				if (diff_tsc < delayed_time)
-					continue;
-
-				if (limit_speed) {
-					uint16_t pkt_size_bit = burst_buffer[i]->pkt_len * 8;
-
-					if (amount_token >= pkt_size_bit)
-						amount_token -= pkt_size_bit;
-					else
-						continue;
-				}
-				do {
-					status = rte_ring_sp_enqueue(workers_to_tx2, burst_buffer[i]);
-				} while (status == -ENOBUFS);
-				i++;
-			} else {
-				do {
-					status = rte_ring_sp_enqueue(workers_to_tx, burst_buffer[i]);
-				} while (status == -ENOBUFS);
-				i++; 
-			}
+		if (idle_polls < IDLE_SLEEP_POLLS)
+			idle_polls++;
+		demu_rtc_idle(idle_polls, ws, dir_mask);
+	}
+}
+
+static unsigned
+demu_main_lcore(void)
+{
+#if DPDK_VERSION >= 21
+	return rte_get_main_lcore();
+#else
+	return rte_get_master_lcore();
+#endif
+}
+
+static int
+demu_launch_one_lcore(__attribute__((unused)) void *dummy)
+{
+	unsigned lcore_id;
+	lcore_id = rte_lcore_id();
+
+	if (rtc_cores == 1) {
+		if (lcore_id == demu_main_lcore())
+			demu_rtc_loop(RTC_DIR_0TO1 | RTC_DIR_1TO0);
+		return 0;
+	}
+
+	if (rtc_cores == 2) {
+		if (lcore_id == demu_main_lcore())
+			demu_rtc_loop(RTC_DIR_0TO1);
+		else if (lcore_id == rte_get_next_lcore(demu_main_lcore(), 1, 0))
+			demu_rtc_loop(RTC_DIR_1TO0);
+		return 0;
+	}
+
+	if (lcore_id == TX_THREAD_CORE) 
+		demu_tx_loop(1);
+
+	else if (lcore_id == TX_THREAD_CORE2)
+		demu_tx_loop(0);
+
+	else if (lcore_id == WORKER_THREAD_CORE)
+		worker_thread(0);
+
+	else if (lcore_id == WORKER_THREAD_CORE2)
+		worker_thread(1);	
+
+	else if (lcore_id == RX_THREAD_CORE)
+		demu_rx_loop(1);
+
+	else if (lcore_id == RX_THREAD_CORE2)
+		demu_rx_loop(0);
+
+	else if (((limit_speed && !tx_pacing) || delayed_jitter || scenario_file) &&
+			lcore_id == TIMER_THREAD_CORE)
+		demu_timer_loop();
+
+	if (force_quit)
+		return 0;
+
+	return 0;
+}
+
+/* display usage */
+static void
+demu_usage(const char *prgname)
+{
+	printf("%s [EAL options] -- -d Delayed time [us] (default is 0s)\n"
+		" -p PORTMASK: HEXADECIMAL bitmask of ports to configure\n"
+		" -r random packet loss %% (default is 0%%)\n"
+		" -g XXX\n"
+		" -s bandwidth limitation [bps]\n"
+		" -D duplicate packet rate\n"
+		" --dup-copies N: maximum number of copies per duplicated packet (default is 1, up to %d)\n"
+		" --dup-dist fixed|uniform|geometric: distribution of the number of copies (default is fixed)\n"
+		" --dup-delay extra delay of each copy [us] (default is 0us)\n"
+		" --hw-timestamp: use NIC RX timestamps as the arrival time if supported\n"
+		" --tx-pacing: send packets at the exact interval of the limited bandwidth\n"
+		" --rtc-cores 1|2: run RX, worker and TX on one lcore for both directions, or one lcore per direction\n"
+		" --idle-sleep sleep time of an idle lcore in the run-to-completion mode [us] (default is 0us, no sleep)\n"
+		" --arena SIZE[K|M|G]: keep packets from port 0 in a byte arena of SIZE bytes instead of mbufs\n"
+		" --fq: fair queueing among flows by deficit round robin with the bandwidth limitation\n"
+		" --fq-quantum quantum of deficit round robin [bytes] (default is %d)\n"
+		" --impair RULE: emulate only packets matching RULE, e.g., proto=udp,dst=10.0.0.2,dport=5001\n"
+		"    (keys: proto=tcp|udp, src, dst, sport, dport; up to %d rules)\n"
+		" --hop KEY=VALUE[,...]: add a hop to the path from port 0 (up to %d), with the keys\n"
+		"    delay [us], rate SPEED[K|M|G], queue SIZE[K|M|G] [bytes], loss [%%], aqm=droptail|codel\n"
+		" --slot period=US,bytes=N: deliver packets from port 0 in aggregates of up to N bytes every US\n"
+		" --slot-trace FILE: deliver packets from port 0 at the opportunities in FILE (Mahimahi format)\n"
+		" --vlan-link VID[-VID]:KEY=VALUE[,...]: emulate a link from port 0 per VLAN ID (up to %d rules), with the keys\n"
+		"    delay [us], rate SPEED[K|M|G], queue SIZE[K|M|G] [bytes], loss [%%]\n"
+		" --cross-traffic KEY=VALUE[,...]: generate cross traffic from port 0, with the keys\n"
+		"    type=cbr|poisson|onoff, rate SPEED[K|M|G], size [bytes] or sizes=FILE, on and off [ms]\n"
+		" --cross-traffic-tx: send the cross traffic out of port 1 instead of discarding it\n"
+		" --port-config PORT:KEY=N[,...]: set rxd, txd (default is %d, %d), rx-burst, tx-burst (default is %d, up to %d) of PORT\n"
+		" --seed N: seed of the random numbers for loss, duplication, jitter and cross traffic\n"
+		" --decision-log FILE: write the random decisions to FILE on exit\n"
+		" --latency-probe N: record the residence time of every Nth packet (default is 0, disabled)\n"
+		" --scenario FILE: apply the timeline of delay, loss, rate and link events in FILE\n"
+		" --scenario-log FILE: write the applied timeline to FILE (default is stdout)\n"
+		" --pcap-in FILE: read the packets to port 0 from FILE instead of the NIC (offline mode)\n"
+		" --pcap-out FILE: write the packets from port 1 to FILE with their emulated times\n"
+		" --buffer-pkts N[K|M]: packets buffered per direction, rounded up to a power of 2 (default is %d, %d offline)\n"
+		" --link-wait MS: time to wait for the links to come up before forwarding [ms] (default is %d)\n",
+		prgname, DEMU_MAX_DUP_COPIES, FQ_DEFAULT_QUANTUM, MAX_IMPAIR_RULES, MAX_HOPS,
+		VLAN_LINK_MAX_RULES,
+		RTE_TEST_RX_DESC_DEFAULT, RTE_TEST_TX_DESC_DEFAULT, PKT_BURST_RX, MAX_PKT_BURST,
+		DEMU_DELAYED_BUFFER_PKTS, DEMU_OFFLINE_BUFFER_PKTS, MAX_CHECK_TIME);
+}
+
+static int
+demu_parse_portmask(const char *portmask)
+{
+	char *end = NULL;
+	unsigned long pm;
+
+	/* parse hexadecimal string */
+	pm = strtoul(portmask, &end, 16);
+	if ((portmask[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+
+	return pm;
+}
+
+static int
+demu_parse_delayed(const char *q_arg)
+{
+	char *end = NULL;
+	int n;
+
+	/* parse number string */
+	n = strtol(q_arg, &end, 10);
+	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+
+	return n;
+}
+
+static int
+demu_parse_jitter(const char *q_arg)
+{
+	char *end = NULL;
+	int n;
+
+	/* parse number string */
+	n = strtol(q_arg, &end, 10);
+	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+	
+	return n;
+}
+
+
+static int64_t
+demu_parse_speed(const char *arg)
+{
+	int64_t speed, base = 1;
+	char *end = NULL;
+
+	speed = strtoul(arg, &end, 10);
+	if (end != NULL) {
+		char unit = *end;
+
+		switch (unit) {
+			case 'k':
+			case 'K':
+				base = 1000;
+				break;
+			case 'm':
+			case 'M':
+				base = 1000 * 1000;
+				break;
+			case 'g':
+			case 'G':
+				if (speed > 10) return -1;
+				base = 1000 * 1000 * 1000;
+				break;
+			default:
+				return -1;
 		}
+		end++;
+	}
+
+	if (arg[0] == '\0' || end == NULL || *end != '\0') {
+		return -1;
+	}
+
+	speed = speed * base;
+	if (speed < 1000 && 10000000000 < speed)
+		return -1;
+
+	return speed;
+}
+
+static int64_t
+demu_parse_size(const char *arg)
+{
+	int64_t size;
+	char *end = NULL;
+
+	size = strtoll(arg, &end, 10);
+	if (arg[0] == '\0' || end == NULL || size <= 0)
+		return -1;
+
+	switch (*end) {
+		case '\0':
+			return size;
+		case 'k':
+		case 'K':
+			size <<= 10;
+			break;
+		case 'm':
+		case 'M':
+			size <<= 20;
+			break;
+		case 'g':
+		case 'G':
+			size <<= 30;
+			break;
+		default:
+			return -1;
+	}
+
+	if (end[1] != '\0')
+		return -1;
+
+	return size;
+}
+
+/* Parse key=value,... of --cross-traffic */
+static int
+demu_parse_cross_traffic(char *arg, struct demu_xt *xt)
+{
+	char *kv, *val, *save = NULL, *end = NULL;
+	int64_t n;
+
+	memset(xt, 0, sizeof(*xt));
+	xt->size = XT_MAX_SIZE;
+	for (kv = strtok_r(arg, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		if (strcmp(kv, "type") == 0) {
+			if (strcmp(val, "cbr") == 0)
+				xt->type = XT_TYPE_CBR;
+			else if (strcmp(val, "poisson") == 0)
+				xt->type = XT_TYPE_POISSON;
+			else if (strcmp(val, "onoff") == 0)
+				xt->type = XT_TYPE_ONOFF;
+			else
+				return -1;
+		} else if (strcmp(kv, "rate") == 0) {
+			n = demu_parse_speed(val);
+			if (n <= 0)
+				return -1;
+			xt->rate = n;
+		} else if (strcmp(kv, "size") == 0) {
+			n = strtoll(val, &end, 10);
+			if (val[0] == '\0' || *end != '\0' || n < XT_MIN_SIZE || n > XT_MAX_SIZE)
+				return -1;
+			xt->size = n;
+		} else if (strcmp(kv, "sizes") == 0) {
+			/* val points into optarg, as scenario_file does */
+			xt->sizes_file = val;
+		} else if (strcmp(kv, "on") == 0 || strcmp(kv, "off") == 0) {
+			n = strtoll(val, &end, 10);
+			if (val[0] == '\0' || *end != '\0' || n <= 0)
+				return -1;
+			if (kv[1] == 'n')
+				xt->on_ms = n;
+			else
+				xt->off_ms = n;
+		} else
+			return -1;
+	}
+
+	if (xt->rate == 0)
+		return -1;
+	if (xt->type == XT_TYPE_ONOFF && (xt->on_ms == 0 || xt->off_ms == 0))
+		return -1;
+
+	return 0;
+}
+
+/* Parse key=value,... of --hop */
+static int
+demu_parse_hop(char *arg, struct demu_hop *h)
+{
+	char *kv, *val, *save = NULL, *end = NULL;
+	int64_t n;
+
+	memset(h, 0, sizeof(*h));
+	for (kv = strtok_r(arg, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		if (strcmp(kv, "delay") == 0) {
+			n = strtoll(val, &end, 10);
+			if (val[0] == '\0' || *end != '\0' || n < 0)
+				return -1;
+			h->delay_in_us = n;
+		} else if (strcmp(kv, "rate") == 0) {
+			n = demu_parse_speed(val);
+			if (n <= 0)
+				return -1;
+			h->rate = n;
+		} else if (strcmp(kv, "queue") == 0) {
+			n = demu_parse_size(val);
+			if (n < 0)
+				return -1;
+			h->queue_limit = n;
+		} else if (strcmp(kv, "loss") == 0) {
+			n = loss_random(val);
+			if (n < 0)
+				return -1;
+			h->loss = n;
+		} else if (strcmp(kv, "aqm") == 0) {
+			if (strcmp(val, "droptail") == 0)
+				h->aqm = HOP_AQM_DROPTAIL;
+			else if (strcmp(val, "codel") == 0)
+				h->aqm = HOP_AQM_CODEL;
+			else
+				return -1;
+		} else
+			return -1;
+	}
+
+	/* a queue needs a link to drain it */
+	if ((h->queue_limit || h->aqm != HOP_AQM_DROPTAIL) && h->rate == 0)
+		return -1;
+
+	return 0;
+}
+
+/* Parse period=US,bytes=N of --slot */
+static int
+demu_parse_slot(char *arg, struct demu_slots *s)
+{
+	char *kv, *val, *save = NULL, *end = NULL;
+	int64_t n;
+
+	for (kv = strtok_r(arg, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		n = strtoll(val, &end, 10);
+		if (val[0] == '\0' || *end != '\0' || n <= 0)
+			return -1;
+		if (strcmp(kv, "period") == 0)
+			s->period_in_us = n;
+		else if (strcmp(kv, "bytes") == 0 && n <= UINT32_MAX)
+			s->bytes = n;
+		else
+			return -1;
 	}
+
+	if (s->period_in_us == 0 || s->bytes == 0)
+		return -1;
+
+	return 0;
 }
 
+/* Parse VID[-VID]:key=value,... of --vlan-link */
 static int
-demu_launch_one_lcore(__attribute__((unused)) void *dummy)
+demu_parse_vlan_link(char *arg, struct demu_vlan_link_rule *r)
 {
-	unsigned lcore_id;
-	lcore_id = rte_lcore_id();
+	char *kv, *val, *save = NULL, *end = NULL;
+	unsigned long first, last;
+	int64_t n;
 
-	if (lcore_id == TX_THREAD_CORE) 
-		demu_tx_loop(1);
+	memset(r, 0, sizeof(*r));
+	first = strtoul(arg, &end, 10);
+	if (end == arg)
+		return -1;
+	last = first;
+	if (*end == '-') {
+		arg = end + 1;
+		last = strtoul(arg, &end, 10);
+		if (end == arg)
+			return -1;
+	}
+	if (*end != ':' || first == 0 || last < first || last >= VLAN_ID_MAX - 1)
+		return -1;
+	r->vid_first = first;
+	r->vid_last = last;
+
+	for (kv = strtok_r(end + 1, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		if (strcmp(kv, "delay") == 0) {
+			n = strtoll(val, &end, 10);
+			if (val[0] == '\0' || *end != '\0' || n < 0)
+				return -1;
+			r->delay_in_us = n;
+		} else if (strcmp(kv, "rate") == 0) {
+			n = demu_parse_speed(val);
+			if (n <= 0)
+				return -1;
+			r->rate = n;
+		} else if (strcmp(kv, "queue") == 0) {
+			n = demu_parse_size(val);
+			if (n < 0)
+				return -1;
+			r->queue_limit = n;
+		} else if (strcmp(kv, "loss") == 0) {
+			n = loss_random(val);
+			if (n < 0)
+				return -1;
+			r->loss = n;
+		} else
+			return -1;
+	}
 
-	else if (lcore_id == TX_THREAD_CORE2)
-		demu_tx_loop(0);
+	/* a queue needs a link to drain it */
+	if (r->queue_limit && r->rate == 0)
+		return -1;
 
-	else if (lcore_id == WORKER_THREAD_CORE)
-		worker_thread(0);
+	return 0;
+}
 
-	else if (lcore_id == WORKER_THREAD_CORE2)
-		worker_thread(1);	
+/* Parse PORT:key=value,... of --port-config */
+static int
+demu_parse_port_config(char *arg)
+{
+	struct demu_port_params *pp;
+	char *kv, *val, *save = NULL, *end = NULL;
+	unsigned long portid, n;
 
-	else if (lcore_id == RX_THREAD_CORE)
-		demu_rx_loop(1);
+	portid = strtoul(arg, &end, 10);
+	if (end == arg || *end != ':' || portid >= RTE_MAX_ETHPORTS)
+		return -1;
+	pp = &port_params[portid];
 
-	else if (lcore_id == RX_THREAD_CORE2)
-		demu_rx_loop(0);
+	for (kv = strtok_r(end + 1, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
 
-	else if ((limit_speed || delayed_jitter) && lcore_id == TIMER_THREAD_CORE)
-		demu_timer_loop();
+		n = strtoul(val, &end, 10);
+		if (val[0] == '\0' || *end != '\0')
+			return -1;
 
-	if (force_quit)
-		return 0;
+		if (strcmp(kv, "rxd") == 0 || strcmp(kv, "txd") == 0) {
+			if (n == 0 || n > UINT16_MAX)
+				return -1;
+			if (kv[0] == 'r')
+				pp->nb_rxd = n;
+			else
+				pp->nb_txd = n;
+		} else if (strcmp(kv, "rx-burst") == 0) {
+			if (n < 2 || n > MAX_PKT_BURST)
+				return -1;
+			pp->rx_burst = n;
+		} else if (strcmp(kv, "tx-burst") == 0) {
+			if (n == 0 || n > MAX_PKT_BURST)
+				return -1;
+			pp->tx_burst = n;
+		} else
+			return -1;
+	}
 
 	return 0;
 }
 
-/* display usage */
-static void
-demu_usage(const char *prgname)
-{
-	printf("%s [EAL options] -- -d Delayed time [us] (default is 0s)\n"
-		" -p PORTMASK: HEXADECIMAL bitmask of ports to configure\n"
-		" -r random packet loss %% (default is 0%%)\n"
-		" -g XXX\n"
-		" -s bandwidth limitation [bps]\n"
-		" -D duplicate packet rate\n",
-		prgname);
-}
-
+/* Parse a comma separated list of key=value as an impairment rule */
 static int
-demu_parse_portmask(const char *portmask)
+demu_parse_impair_rule(char *arg, struct demu_impair_rule *r)
 {
-	char *end = NULL;
-	unsigned long pm;
+	char *kv, *val, *save = NULL, *end = NULL;
+	unsigned long port;
+
+	memset(r, 0, sizeof(*r));
+	for (kv = strtok_r(arg, ",", &save); kv != NULL; kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		if (strcmp(kv, "proto") == 0) {
+			if (strcmp(val, "tcp") == 0)
+				r->proto = IPPROTO_TCP;
+			else if (strcmp(val, "udp") == 0)
+				r->proto = IPPROTO_UDP;
+			else
+				return -1;
+		} else if (strcmp(kv, "src") == 0) {
+			if (inet_pton(AF_INET, val, &r->src_ip) != 1)
+				return -1;
+		} else if (strcmp(kv, "dst") == 0) {
+			if (inet_pton(AF_INET, val, &r->dst_ip) != 1)
+				return -1;
+		} else if (strcmp(kv, "sport") == 0 || strcmp(kv, "dport") == 0) {
+			port = strtoul(val, &end, 10);
+			if (val[0] == '\0' || *end != '\0' || port == 0 || port > UINT16_MAX)
+				return -1;
+			if (kv[0] == 's')
+				r->src_port = htons(port);
+			else
+				r->dst_port = htons(port);
+		} else
+			return -1;
+	}
 
-	/* parse hexadecimal string */
-	pm = strtoul(portmask, &end, 16);
-	if ((portmask[0] == '\0') || (end == NULL) || (*end != '\0'))
+	/* ports can be matched only with a protocol */
+	if ((r->src_port || r->dst_port) && r->proto == 0)
 		return -1;
 
-	return pm;
+	return 0;
 }
 
 static int
-demu_parse_delayed(const char *q_arg)
+demu_parse_dup_copies(const char *q_arg)
 {
 	char *end = NULL;
 	int n;
@@ -555,66 +4031,229 @@ demu_parse_delayed(const char *q_arg)
 	n = strtol(q_arg, &end, 10);
 	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
 		return -1;
+	if (n < 1 || n > DEMU_MAX_DUP_COPIES)
+		return -1;
 
 	return n;
 }
 
 static int
-demu_parse_jitter(const char *q_arg)
+demu_parse_dup_dist(const char *q_arg)
 {
-	char *end = NULL;
-	int n;
-
-	/* parse number string */
-	n = strtol(q_arg, &end, 10);
-	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
-		return -1;
-	
-	return n;
+	if (strcmp(q_arg, "fixed") == 0)
+		return DUP_DIST_FIXED;
+	if (strcmp(q_arg, "uniform") == 0)
+		return DUP_DIST_UNIFORM;
+	if (strcmp(q_arg, "geometric") == 0)
+		return DUP_DIST_GEOMETRIC;
+
+	return -1;
 }
 
+static uint64_t
+scenario_step_ms(const struct demu_scenario_step *step)
+{
+	const struct demu_scenario_event *ev = &scenario_events[step->ev];
 
-static int64_t
-demu_parse_speed(const char *arg)
+	return step->restore ? ev->at_ms + ev->ramp_ms + ev->for_ms : ev->at_ms;
+}
+
+/*
+ * Load a scenario file. Each line is
+ *   <time [ms]> delay <delay time [us]>|loss <loss rate [%]>|rate <speed[K|M|G]>|down|up
+ *               [ramp <duration [ms]>] [for <duration [ms]>]
+ * and '#' starts a comment. With ramp, the value changes linearly from the
+ * current one. With for, the previous value is restored after the duration
+ * (following the ramp).
+ */
+static int
+demu_load_scenario(const char *file)
 {
-	int64_t speed, base = 1;
-	char *end = NULL;
+	FILE *fp;
+	char line[256];
+	char *tok[8], *save, *t;
+	unsigned lineno = 0;
+	unsigned i, j, n, k;
+	int64_t val;
+	struct demu_scenario_event *ev;
+	struct demu_scenario_step step;
 
-	speed = strtoul(arg, &end, 10);
-	if (end != NULL) {
-		char unit = *end;
+	if ((fp = fopen(file, "r")) == NULL) {
+		printf("Cannot open scenario file %s\n", file);
+		return -1;
+	}
 
-		switch (unit) {
-			case 'k':
-			case 'K':
-				base = 1000;
-				break;
-			case 'm':
-			case 'M':
-				base = 1000 * 1000;
-				break;
-			case 'g':
-			case 'G':
-				if (speed > 10) return -1;
-				base = 1000 * 1000 * 1000;
-				break;
-			default:
-				return -1;
-		}
-		end++;
+	scenario_events = rte_zmalloc("scenario_events",
+			sizeof(*scenario_events) * SCENARIO_MAX_EVENTS, 0);
+	scenario_steps = rte_zmalloc("scenario_steps",
+			sizeof(*scenario_steps) * SCENARIO_MAX_EVENTS * 2, 0);
+	scenario_log = rte_zmalloc("scenario_log",
+			sizeof(*scenario_log) * SCENARIO_LOG_MAX, 0);
+	if (scenario_events == NULL || scenario_steps == NULL || scenario_log == NULL) {
+		printf("Cannot allocate scenario\n");
+		goto error;
 	}
 
-	if (arg[0] == '\0' || end == NULL || *end != '\0') {
-		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		/* a line longer than the buffer would be read as two */
+		if (strchr(line, '\n') == NULL && !feof(fp))
+			goto invalid;
+		if ((t = strchr(line, '#')) != NULL)
+			*t = '\0';
+
+		n = 0;
+		for (t = strtok_r(line, " \t\r\n", &save); t != NULL && n < RTE_DIM(tok);
+				t = strtok_r(NULL, " \t\r\n", &save))
+			tok[n++] = t;
+		if (n == 0)
+			continue;
+
+		/* do not apply a line partially */
+		if (t != NULL)
+			goto invalid;
+
+		if (n < 2 || scenario_nb_events == SCENARIO_MAX_EVENTS)
+			goto invalid;
+
+		ev = &scenario_events[scenario_nb_events];
+		if ((val = demu_parse_delayed(tok[0])) < 0)
+			goto invalid;
+		ev->at_ms = val;
+
+		i = 2;
+		if (strcmp(tok[1], "down") == 0 || strcmp(tok[1], "up") == 0) {
+			ev->param = SCENARIO_LINK;
+			ev->value = (tok[1][0] == 'u');
+		} else {
+			if (n < 3)
+				goto invalid;
+			i = 3;
+			if (strcmp(tok[1], "delay") == 0) {
+				ev->param = SCENARIO_DELAY;
+				val = demu_parse_delayed(tok[2]);
+			} else if (strcmp(tok[1], "loss") == 0) {
+				ev->param = SCENARIO_LOSS;
+				val = loss_random(tok[2]);
+			} else if (strcmp(tok[1], "rate") == 0) {
+				ev->param = SCENARIO_RATE;
+				val = strcmp(tok[2], "0") == 0 ? 0 : demu_parse_speed(tok[2]);
+				scenario_has_rate = true;
+			} else
+				goto invalid;
+			if (val < 0)
+				goto invalid;
+			ev->value = val;
+		}
+
+		for (; i + 1 < n; i += 2) {
+			if ((val = demu_parse_delayed(tok[i + 1])) < 0)
+				goto invalid;
+			if (strcmp(tok[i], "ramp") == 0 && ev->param != SCENARIO_LINK)
+				ev->ramp_ms = val;
+			else if (strcmp(tok[i], "for") == 0)
+				ev->for_ms = val;
+			else
+				goto invalid;
+		}
+		if (i != n)
+			goto invalid;
+
+		if (ev->param == SCENARIO_LOSS && loss_mode != LOSS_MODE_NONE &&
+				loss_mode != LOSS_MODE_RANDOM) {
+			printf("Scenario loss events require random loss\n");
+			goto error;
+		}
+
+		scenario_nb_events++;
+	}
+	fclose(fp);
+
+	/* sort the steps by time, keeping the order of the file for ties */
+	for (i = 0; i < scenario_nb_events; i++) {
+		for (k = 0; k < (scenario_events[i].for_ms ? 2u : 1u); k++) {
+			step.ev = i;
+			step.restore = k;
+			j = scenario_nb_steps++;
+			while (j > 0 && scenario_step_ms(&scenario_steps[j - 1]) > scenario_step_ms(&step)) {
+				scenario_steps[j] = scenario_steps[j - 1];
+				j--;
+			}
+			scenario_steps[j] = step;
+		}
 	}
 
-	speed = speed * base;
-	if (speed < 1000 && 10000000000 < speed)
-		return -1;
+	return 0;
 
-	return speed;
+invalid:
+	printf("Invalid scenario: %s line %u\n", file, lineno);
+error:
+	fclose(fp);
+	return -1;
 }
 
+#define CMD_LINE_OPT_DUP_COPIES "dup-copies"
+#define CMD_LINE_OPT_DUP_DIST "dup-dist"
+#define CMD_LINE_OPT_DUP_DELAY "dup-delay"
+#define CMD_LINE_OPT_HW_TIMESTAMP "hw-timestamp"
+#define CMD_LINE_OPT_TX_PACING "tx-pacing"
+#define CMD_LINE_OPT_RTC_CORES "rtc-cores"
+#define CMD_LINE_OPT_IDLE_SLEEP "idle-sleep"
+#define CMD_LINE_OPT_ARENA "arena"
+#define CMD_LINE_OPT_FQ "fq"
+#define CMD_LINE_OPT_FQ_QUANTUM "fq-quantum"
+#define CMD_LINE_OPT_IMPAIR "impair"
+#define CMD_LINE_OPT_HOP "hop"
+#define CMD_LINE_OPT_SLOT "slot"
+#define CMD_LINE_OPT_SLOT_TRACE "slot-trace"
+#define CMD_LINE_OPT_VLAN_LINK "vlan-link"
+#define CMD_LINE_OPT_CROSS_TRAFFIC "cross-traffic"
+#define CMD_LINE_OPT_CROSS_TRAFFIC_TX "cross-traffic-tx"
+#define CMD_LINE_OPT_PORT_CONFIG "port-config"
+#define CMD_LINE_OPT_SEED "seed"
+#define CMD_LINE_OPT_DECISION_LOG "decision-log"
+#define CMD_LINE_OPT_LATENCY_PROBE "latency-probe"
+#define CMD_LINE_OPT_SCENARIO "scenario"
+#define CMD_LINE_OPT_SCENARIO_LOG "scenario-log"
+#define CMD_LINE_OPT_PCAP_IN "pcap-in"
+#define CMD_LINE_OPT_PCAP_OUT "pcap-out"
+#define CMD_LINE_OPT_BUFFER_PKTS "buffer-pkts"
+#define CMD_LINE_OPT_LINK_WAIT "link-wait"
+enum {
+	/* long options mapped to a short option */
+
+	/* first long only option value must be >= 256, so that we won't
+	 * conflict with short options */
+	CMD_LINE_OPT_MIN_NUM = 256,
+	CMD_LINE_OPT_DUP_COPIES_NUM,
+	CMD_LINE_OPT_DUP_DIST_NUM,
+	CMD_LINE_OPT_DUP_DELAY_NUM,
+	CMD_LINE_OPT_HW_TIMESTAMP_NUM,
+	CMD_LINE_OPT_TX_PACING_NUM,
+	CMD_LINE_OPT_RTC_CORES_NUM,
+	CMD_LINE_OPT_IDLE_SLEEP_NUM,
+	CMD_LINE_OPT_ARENA_NUM,
+	CMD_LINE_OPT_FQ_NUM,
+	CMD_LINE_OPT_FQ_QUANTUM_NUM,
+	CMD_LINE_OPT_IMPAIR_NUM,
+	CMD_LINE_OPT_HOP_NUM,
+	CMD_LINE_OPT_SLOT_NUM,
+	CMD_LINE_OPT_SLOT_TRACE_NUM,
+	CMD_LINE_OPT_VLAN_LINK_NUM,
+	CMD_LINE_OPT_CROSS_TRAFFIC_NUM,
+	CMD_LINE_OPT_CROSS_TRAFFIC_TX_NUM,
+	CMD_LINE_OPT_PORT_CONFIG_NUM,
+	CMD_LINE_OPT_SEED_NUM,
+	CMD_LINE_OPT_DECISION_LOG_NUM,
+	CMD_LINE_OPT_LATENCY_PROBE_NUM,
+	CMD_LINE_OPT_SCENARIO_NUM,
+	CMD_LINE_OPT_SCENARIO_LOG_NUM,
+	CMD_LINE_OPT_PCAP_IN_NUM,
+	CMD_LINE_OPT_PCAP_OUT_NUM,
+	CMD_LINE_OPT_BUFFER_PKTS_NUM,
+	CMD_LINE_OPT_LINK_WAIT_NUM,
+};
+
 /* Parse the argument given in the command line of the application */
 static int
 demu_parse_args(int argc, char **argv)
@@ -623,6 +4262,33 @@ demu_parse_args(int argc, char **argv)
 	char **argvopt;
 	char *prgname = argv[0];
 	const struct option longopts[] = {
+		{CMD_LINE_OPT_DUP_COPIES, required_argument, 0, CMD_LINE_OPT_DUP_COPIES_NUM},
+		{CMD_LINE_OPT_DUP_DIST, required_argument, 0, CMD_LINE_OPT_DUP_DIST_NUM},
+		{CMD_LINE_OPT_DUP_DELAY, required_argument, 0, CMD_LINE_OPT_DUP_DELAY_NUM},
+		{CMD_LINE_OPT_HW_TIMESTAMP, no_argument, 0, CMD_LINE_OPT_HW_TIMESTAMP_NUM},
+		{CMD_LINE_OPT_TX_PACING, no_argument, 0, CMD_LINE_OPT_TX_PACING_NUM},
+		{CMD_LINE_OPT_RTC_CORES, required_argument, 0, CMD_LINE_OPT_RTC_CORES_NUM},
+		{CMD_LINE_OPT_IDLE_SLEEP, required_argument, 0, CMD_LINE_OPT_IDLE_SLEEP_NUM},
+		{CMD_LINE_OPT_ARENA, required_argument, 0, CMD_LINE_OPT_ARENA_NUM},
+		{CMD_LINE_OPT_FQ, no_argument, 0, CMD_LINE_OPT_FQ_NUM},
+		{CMD_LINE_OPT_FQ_QUANTUM, required_argument, 0, CMD_LINE_OPT_FQ_QUANTUM_NUM},
+		{CMD_LINE_OPT_IMPAIR, required_argument, 0, CMD_LINE_OPT_IMPAIR_NUM},
+		{CMD_LINE_OPT_HOP, required_argument, 0, CMD_LINE_OPT_HOP_NUM},
+		{CMD_LINE_OPT_SLOT, required_argument, 0, CMD_LINE_OPT_SLOT_NUM},
+		{CMD_LINE_OPT_SLOT_TRACE, required_argument, 0, CMD_LINE_OPT_SLOT_TRACE_NUM},
+		{CMD_LINE_OPT_VLAN_LINK, required_argument, 0, CMD_LINE_OPT_VLAN_LINK_NUM},
+		{CMD_LINE_OPT_CROSS_TRAFFIC, required_argument, 0, CMD_LINE_OPT_CROSS_TRAFFIC_NUM},
+		{CMD_LINE_OPT_CROSS_TRAFFIC_TX, no_argument, 0, CMD_LINE_OPT_CROSS_TRAFFIC_TX_NUM},
+		{CMD_LINE_OPT_PORT_CONFIG, required_argument, 0, CMD_LINE_OPT_PORT_CONFIG_NUM},
+		{CMD_LINE_OPT_SEED, required_argument, 0, CMD_LINE_OPT_SEED_NUM},
+		{CMD_LINE_OPT_DECISION_LOG, required_argument, 0, CMD_LINE_OPT_DECISION_LOG_NUM},
+		{CMD_LINE_OPT_LATENCY_PROBE, required_argument, 0, CMD_LINE_OPT_LATENCY_PROBE_NUM},
+		{CMD_LINE_OPT_SCENARIO, required_argument, 0, CMD_LINE_OPT_SCENARIO_NUM},
+		{CMD_LINE_OPT_SCENARIO_LOG, required_argument, 0, CMD_LINE_OPT_SCENARIO_LOG_NUM},
+		{CMD_LINE_OPT_PCAP_IN, required_argument, 0, CMD_LINE_OPT_PCAP_IN_NUM},
+		{CMD_LINE_OPT_PCAP_OUT, required_argument, 0, CMD_LINE_OPT_PCAP_OUT_NUM},
+		{CMD_LINE_OPT_BUFFER_PKTS, required_argument, 0, CMD_LINE_OPT_BUFFER_PKTS_NUM},
+		{CMD_LINE_OPT_LINK_WAIT, required_argument, 0, CMD_LINE_OPT_LINK_WAIT_NUM},
 		{0, 0, 0, 0}
 	};
 	int longindex = 0;
@@ -666,51 +4332,288 @@ demu_parse_args(int argc, char **argv)
 					return -1;
 				}
 
-				delayed_jitter = val;
+				delayed_jitter = val;
+				break;
+
+			/* random packet loss */
+			case 'r':
+				val = loss_random(optarg);
+				if (val < 0) {
+					printf("Invalid value: loss rate\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				loss_percent_1 = val;
+				loss_mode = LOSS_MODE_RANDOM;
+				break;
+
+			case 'g':
+				val = loss_random(optarg);
+				if (val < 0) {
+					printf("Invalid value: loss rate\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				loss_percent_2 = val;
+				loss_mode = LOSS_MODE_GE;
+				break;
+
+			/* duplicate packet */
+			case 'D':
+				val = loss_random(optarg);
+				if (val < 0) {
+					printf("Invalid value: loss rate\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				dup_rate = val;
+				break;
+
+			/* bandwidth limitation */
+			case 's':
+				val = demu_parse_speed(optarg);
+				if (val < 0) {
+					RTE_LOG(ERR, DEMU, "Invalid value: speed\n");
+					return -1;
+				}
+				limit_speed = val;
+				break;
+
+			/* number of copies of a duplicated packet */
+			case CMD_LINE_OPT_DUP_COPIES_NUM:
+				val = demu_parse_dup_copies(optarg);
+				if (val < 0) {
+					printf("Invalid value: dup copies\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				dup_copies = val;
+				break;
+
+			case CMD_LINE_OPT_DUP_DIST_NUM:
+				val = demu_parse_dup_dist(optarg);
+				if (val < 0) {
+					printf("Invalid value: dup distribution\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				dup_dist = val;
+				break;
+
+			/* extra delay of each copy */
+			case CMD_LINE_OPT_DUP_DELAY_NUM:
+				val = demu_parse_delayed(optarg);
+				if (val < 0) {
+					printf("Invalid value: dup delay\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				dup_delay_in_us = val;
+				dup_delay = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * val;
+				break;
+
+			/* NIC hardware RX timestamps */
+			case CMD_LINE_OPT_HW_TIMESTAMP_NUM:
+				hw_timestamp = true;
+				break;
+
+			/* paced transmission */
+			case CMD_LINE_OPT_TX_PACING_NUM:
+				tx_pacing = true;
+				break;
+
+			/* run-to-completion mode */
+			case CMD_LINE_OPT_RTC_CORES_NUM:
+				val = demu_parse_delayed(optarg);
+				if (val != 1 && val != 2) {
+					printf("Invalid value: rtc cores\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				rtc_cores = val;
+				break;
+
+			case CMD_LINE_OPT_IDLE_SLEEP_NUM:
+				val = demu_parse_delayed(optarg);
+				if (val < 0) {
+					printf("Invalid value: idle sleep\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				idle_sleep_us = val;
+				break;
+
+			/* byte arena delay line */
+			case CMD_LINE_OPT_ARENA_NUM:
+				val = demu_parse_size(optarg);
+				if (val < 4096) {
+					printf("Invalid value: arena size\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				arena_size = val & ~(uint64_t)(ARENA_ALIGN - 1);
+				break;
+
+			/* fair queueing */
+			case CMD_LINE_OPT_FQ_NUM:
+				fq_enabled = true;
+				break;
+
+			case CMD_LINE_OPT_FQ_QUANTUM_NUM:
+				val = demu_parse_delayed(optarg);
+				if (val <= 0) {
+					printf("Invalid value: fq quantum\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				fq_quantum = val;
+				break;
+
+			/* selective impairment */
+			case CMD_LINE_OPT_IMPAIR_NUM:
+				if (nb_impair_rules == MAX_IMPAIR_RULES ||
+						demu_parse_impair_rule(optarg, &impair_rules[nb_impair_rules]) < 0) {
+					printf("Invalid value: impair rule\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				nb_impair_rules++;
+				break;
+
+			/* multi-hop path */
+			case CMD_LINE_OPT_HOP_NUM:
+				if (nb_hops == MAX_HOPS || demu_parse_hop(optarg, &hops[nb_hops]) < 0) {
+					printf("Invalid value: hop\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				nb_hops++;
+				break;
+
+			/* slotted delivery */
+			case CMD_LINE_OPT_SLOT_NUM:
+				if (slots.trace_file || demu_parse_slot(optarg, &slots) < 0) {
+					printf("Invalid value: slot\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				slot_enabled = true;
+				break;
+
+			case CMD_LINE_OPT_SLOT_TRACE_NUM:
+				/* the trace replaces the period and the budget */
+				if (slot_enabled) {
+					printf("Invalid value: slot trace with slot\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				slots.trace_file = optarg;
+				slot_enabled = true;
+				break;
+
+			/* VLAN-multiplexed links */
+			case CMD_LINE_OPT_VLAN_LINK_NUM:
+				if (nb_vlan_link_rules == VLAN_LINK_MAX_RULES ||
+						demu_parse_vlan_link(optarg, &vlan_link_rules[nb_vlan_link_rules]) < 0) {
+					printf("Invalid value: vlan link\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				nb_vlan_link_rules++;
+				break;
+
+			/* cross traffic */
+			case CMD_LINE_OPT_CROSS_TRAFFIC_NUM:
+				if (demu_parse_cross_traffic(optarg, &cross_traffic) < 0) {
+					printf("Invalid value: cross traffic\n");
+					demu_usage(prgname);
+					return -1;
+				}
+				xt_enabled = true;
+				break;
+
+			case CMD_LINE_OPT_CROSS_TRAFFIC_TX_NUM:
+				xt_transmit = true;
 				break;
 
-			/* random packet loss */
-			case 'r':
-				val = loss_random(optarg);
-				if (val < 0) {
-					printf("Invalid value: loss rate\n");
+			/* descriptors and burst sizes of a port */
+			case CMD_LINE_OPT_PORT_CONFIG_NUM:
+				if (demu_parse_port_config(optarg) < 0) {
+					printf("Invalid value: port config\n");
 					demu_usage(prgname);
 					return -1;
 				}
-				loss_percent_1 = val;
-				loss_mode = LOSS_MODE_RANDOM;
 				break;
 
-			case 'g':
-				val = loss_random(optarg);
+			/* reproducible random decisions */
+			case CMD_LINE_OPT_SEED_NUM:
+				{
+					char *end = NULL;
+
+					demu_seed = strtoull(optarg, &end, 0);
+					if (optarg[0] == '\0' || *end != '\0') {
+						printf("Invalid value: seed\n");
+						demu_usage(prgname);
+						return -1;
+					}
+					seed_given = true;
+				}
+				break;
+
+			case CMD_LINE_OPT_DECISION_LOG_NUM:
+				decision_log_file = optarg;
+				break;
+
+			/* delay accuracy probe */
+			case CMD_LINE_OPT_LATENCY_PROBE_NUM:
+				val = demu_parse_delayed(optarg);
 				if (val < 0) {
-					printf("Invalid value: loss rate\n");
+					printf("Invalid value: latency probe\n");
 					demu_usage(prgname);
 					return -1;
 				}
-				loss_percent_2 = val;
-				loss_mode = LOSS_MODE_GE;
+				latency_probe = val;
 				break;
 
-			/* duplicate packet */
-			case 'D':
-				val = loss_random(optarg);
-				if (val < 0) {
-					printf("Invalid value: loss rate\n");
+			/* scenario timeline */
+			case CMD_LINE_OPT_SCENARIO_NUM:
+				scenario_file = optarg;
+				break;
+
+			case CMD_LINE_OPT_SCENARIO_LOG_NUM:
+				scenario_log_file = optarg;
+				break;
+
+			/* offline mode */
+			case CMD_LINE_OPT_PCAP_IN_NUM:
+				pcap_in_file = optarg;
+				break;
+
+			case CMD_LINE_OPT_PCAP_OUT_NUM:
+				pcap_out_file = optarg;
+				break;
+
+			/* startup */
+			case CMD_LINE_OPT_BUFFER_PKTS_NUM:
+				val = demu_parse_size(optarg);
+				if (val < DEMU_MIN_BUFFER_PKTS || val > DEMU_MAX_BUFFER_PKTS) {
+					printf("Invalid value: buffer pkts\n");
 					demu_usage(prgname);
 					return -1;
 				}
-				dup_rate = val;
+				/* the rings need a power of 2 */
+				delayed_buffer_pkts = rte_align32pow2(val);
+				buffer_pkts_set = true;
 				break;
 
-			/* bandwidth limitation */
-			case 's':
-				val = demu_parse_speed(optarg);
+			case CMD_LINE_OPT_LINK_WAIT_NUM:
+				val = demu_parse_delayed(optarg);
 				if (val < 0) {
-					RTE_LOG(ERR, DEMU, "Invalid value: speed\n");
+					printf("Invalid value: link wait\n");
+					demu_usage(prgname);
 					return -1;
 				}
-				limit_speed = val;
+				link_wait_ms = val;
 				break;
 
 			/* long options */
@@ -724,6 +4627,98 @@ demu_parse_args(int argc, char **argv)
 		}
 	}
 
+	if (scenario_file && demu_load_scenario(scenario_file) < 0)
+		return -1;
+
+	if (pcap_in_file || pcap_out_file) {
+		if (pcap_in_file == NULL || pcap_out_file == NULL) {
+			RTE_LOG(ERR, DEMU, "Offline mode needs both --pcap-in and --pcap-out\n");
+			return -1;
+		}
+		if (arena_size || rtc_cores || hw_timestamp || nb_impair_rules || scenario_file) {
+			RTE_LOG(ERR, DEMU, "Offline mode cannot be used with --arena, --rtc-cores,"
+				" --hw-timestamp, --impair, or --scenario\n");
+			return -1;
+		}
+		offline = true;
+		if (!buffer_pkts_set)
+			delayed_buffer_pkts = DEMU_OFFLINE_BUFFER_PKTS;
+		/* the token bucket is refilled by a timer on the real clock */
+		if (limit_speed)
+			tx_pacing = true;
+	}
+
+	if (nb_hops) {
+		uint64_t tsc_per_us = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S;
+		unsigned n;
+
+		if (limit_speed || scenario_has_rate || arena_size || fq_enabled || tx_pacing) {
+			RTE_LOG(ERR, DEMU, "Multi-hop path cannot be used with -s, a scenario rate event,"
+				" --arena, --fq, or --tx-pacing\n");
+			return -1;
+		}
+		for (n = 0; n < nb_hops; n++) {
+			hops[n].delay = tsc_per_us * hops[n].delay_in_us;
+			if (hops[n].rate)
+				hops[n].cycles_per_byte = (double)rte_get_tsc_hz() * 8 / hops[n].rate;
+		}
+		codel_target = tsc_per_us * CODEL_TARGET_US;
+		codel_interval = tsc_per_us * CODEL_INTERVAL_US;
+	}
+
+	if (slot_enabled) {
+		if (limit_speed || scenario_has_rate || arena_size || fq_enabled || nb_hops) {
+			RTE_LOG(ERR, DEMU, "Slotted delivery cannot be used with -s, a scenario rate event,"
+				" --arena, --fq, or --hop\n");
+			return -1;
+		}
+		if (slot_init(&slots) < 0)
+			return -1;
+	}
+
+	if (nb_vlan_link_rules) {
+		unsigned n, m;
+
+		if (limit_speed || scenario_has_rate || tx_pacing || arena_size || fq_enabled ||
+				nb_hops || slot_enabled) {
+			RTE_LOG(ERR, DEMU, "VLAN links cannot be used with -s, a scenario rate event,"
+				" --tx-pacing, --arena, --fq, --hop, or --slot\n");
+			return -1;
+		}
+		for (n = 0; n < nb_vlan_link_rules; n++) {
+			for (m = 0; m < n; m++) {
+				if (vlan_link_rules[n].vid_first <= vlan_link_rules[m].vid_last &&
+						vlan_link_rules[m].vid_first <= vlan_link_rules[n].vid_last) {
+					RTE_LOG(ERR, DEMU, "VLAN links overlap\n");
+					return -1;
+				}
+			}
+		}
+	}
+
+	/* the byte arena does not keep which pool a packet came from */
+	if (xt_enabled && arena_size) {
+		RTE_LOG(ERR, DEMU, "Cross traffic cannot be used with --arena\n");
+		return -1;
+	}
+	if (!xt_enabled)
+		xt_transmit = false;
+
+	if (fq_enabled && (limit_speed == 0 || arena_size)) {
+		RTE_LOG(WARNING, DEMU, "Fair queueing requires bandwidth limitation (-s) without arena, ignored\n");
+		fq_enabled = false;
+	}
+
+	if (tx_pacing) {
+		if (limit_speed == 0) {
+			RTE_LOG(WARNING, DEMU, "TX pacing requires bandwidth limitation (-s), ignored\n");
+			tx_pacing = false;
+		} else {
+			pacing_cycles_per_byte = (double)rte_get_tsc_hz() * 8 / limit_speed;
+			pacing_horizon = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * PACING_HORIZON_US;
+		}
+	}
+
 	if (optind >= 0)
 		argv[optind-1] = prgname;
 
@@ -732,16 +4727,237 @@ demu_parse_args(int argc, char **argv)
 	return ret;
 }
 
+/* Features of the datapath of each port, which select the specialized loops */
+static void
+demu_select_features(void)
+{
+	/* a scenario may enable the loss and the bandwidth limitation later */
+	bool loss = loss_mode != LOSS_MODE_NONE || scenario_file;
+	bool shape = limit_speed || scenario_file;
+
+	rx_features[0] = (loss ? DP_RX_LOSS : 0) | (dup_rate ? DP_RX_DUP : 0);
+	worker_features[0] = DP_W_DELAY | (shape ? DP_W_SHAPE : 0) | (tx_pacing ? DP_W_PACED : 0);
+	tx_features[1] = tx_pacing ? DP_TX_PACED : 0;
+
+	if (latency_probe) {
+		tx_features[0] |= DP_TX_PROBE;
+		tx_features[1] |= DP_TX_PROBE;
+	}
+}
+
+/*
+ * The ethdev control path is not thread-safe, and ports of the same
+ * adapter share the driver state, so the ports are configured and started
+ * one by one. Only the waits which do not touch the configuration run in
+ * parallel: the NIC clocks are calibrated on one lcore per port before the
+ * lcores start forwarding, and check_all_ports_link_status() polls all
+ * the links at once.
+ */
+static int
+demu_init_port(uint8_t portid)
+{
+	int ret;
+	struct rte_eth_conf local_port_conf = port_conf;
+	uint16_t nb_rxq = (nb_impair_rules && portid == 0 && steer_hw) ? 2 : 1;
+	uint16_t nb_txq = (nb_impair_rules && portid == 1) ? 2 : 1;
+	uint16_t nb_rxd = port_params[portid].nb_rxd;
+	uint16_t nb_txd = port_params[portid].nb_txd;
+	const struct rte_eth_rxconf *rxq_conf = &rx_conf;
+	const struct rte_eth_txconf *txq_conf = &tx_conf;
+	uint16_t q;
+#if DPDK_VERSION >= 18
+	struct rte_eth_dev_info dev_info;
+	struct rte_eth_rxconf local_rx_conf;
+	struct rte_eth_txconf local_tx_conf;
+#endif
+
+	/* init port */
+	RTE_LOG(INFO, DEMU, "Initializing port %u\n", (unsigned) portid);
+#if DPDK_VERSION >= 18
+	memset(&dev_info, 0, sizeof(dev_info));
+	rte_eth_dev_info_get(portid, &dev_info);
+
+	/*
+	 * All the packets come from demu_pktmbuf_pool with a refcnt of 1,
+	 * except for the clones made for duplication and the cross
+	 * traffic, which leave port 1.
+	 */
+	if ((dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE) &&
+			!(portid == 1 && (dup_rate || xt_transmit)))
+		local_port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
+#endif
+#if DEMU_MBUF_DYN
+	if (hw_timestamp) {
+		if (dev_info.rx_offload_capa & RTE_ETH_RX_OFFLOAD_TIMESTAMP) {
+			local_port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_TIMESTAMP;
+			hwts_clock[portid].enabled = true;
+		} else
+			RTE_LOG(WARNING, DEMU, "  Port %u does not support RX timestamps, use TSC instead\n",
+				(unsigned) portid);
+	}
+
+	if (tx_pacing && portid == 1 && txts_dynfield_offset >= 0) {
+		if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP) {
+			local_port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP;
+			txts_clock[portid].enabled = true;
+		}
+	}
+#endif
+	ret = rte_eth_dev_configure(portid, nb_rxq, nb_txq, &local_port_conf);
+	if (ret < 0) {
+		RTE_LOG(ERR, DEMU, "Cannot configure device: err=%d, port=%u\n",
+				ret, (unsigned) portid);
+		return -1;
+	}
+
+#if DPDK_VERSION >= 18
+	ret = rte_eth_dev_adjust_nb_rx_tx_desc(portid, &nb_rxd, &nb_txd);
+	if (ret < 0) {
+		RTE_LOG(ERR, DEMU, "Cannot adjust number of descriptors: err=%d, port=%u\n",
+				ret, (unsigned) portid);
+		return -1;
+	}
+
+	local_rx_conf = dev_info.default_rxconf;
+	local_rx_conf.offloads = local_port_conf.rxmode.offloads;
+	rxq_conf = &local_rx_conf;
+	local_tx_conf = dev_info.default_txconf;
+	local_tx_conf.offloads = local_port_conf.txmode.offloads;
+	txq_conf = &local_tx_conf;
+
+	RTE_LOG(INFO, DEMU, "  Port %u: %u RX/%u TX descriptors, burst %u/%u, fast free %s\n",
+		(unsigned) portid, nb_rxd, nb_txd, port_params[portid].rx_burst, port_params[portid].tx_burst,
+		(local_port_conf.txmode.offloads & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE) ? "on" : "off");
+#endif
+
+	rte_eth_macaddr_get(portid,&demu_ports_eth_addr[portid]);
+
+	/* init RX queues */
+	for (q = 0; q < nb_rxq; q++) {
+		ret = rte_eth_rx_queue_setup(portid, q, nb_rxd,
+				rte_eth_dev_socket_id(portid),
+				rxq_conf,
+				demu_pktmbuf_pool);
+		if (ret < 0) {
+			RTE_LOG(ERR, DEMU, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
+					ret, (unsigned) portid);
+			return -1;
+		}
+	}
+
+	/* init TX queues on each port */
+	for (q = 0; q < nb_txq; q++) {
+		ret = rte_eth_tx_queue_setup(portid, q, nb_txd,
+				rte_eth_dev_socket_id(portid),
+				txq_conf);
+		if (ret < 0) {
+			RTE_LOG(ERR, DEMU, "rte_eth_tx_queue_setup:err=%d, port=%u\n",
+					ret, (unsigned) portid);
+			return -1;
+		}
+	}
+
+	/* Start device */
+	ret = rte_eth_dev_start(portid);
+	if (ret < 0) {
+		RTE_LOG(ERR, DEMU, "rte_eth_dev_start:err=%d, port=%u\n",
+				ret, (unsigned) portid);
+		return -1;
+	}
+
+	rte_eth_promiscuous_enable(portid);
+
+	if (nb_rxq == 2) {
+		steer_nb_rxq = nb_rxq;
+		steer_hw = impair_flow_create(portid);
+		RTE_LOG(INFO, DEMU, "  Port %u steers impaired traffic by %s\n",
+			(unsigned) portid, steer_hw ? "rte_flow" : "software");
+	}
+
+	RTE_LOG(INFO, DEMU, "  Port %u, MAC address: %02X:%02X:%02X:%02X:%02X:%02X\n",
+		(unsigned) portid,
+		demu_ports_eth_addr[portid].addr_bytes[0],
+		demu_ports_eth_addr[portid].addr_bytes[1],
+		demu_ports_eth_addr[portid].addr_bytes[2],
+		demu_ports_eth_addr[portid].addr_bytes[3],
+		demu_ports_eth_addr[portid].addr_bytes[4],
+		demu_ports_eth_addr[portid].addr_bytes[5]);
+
+	return 0;
+}
+
+#if DEMU_MBUF_DYN
+static int
+demu_calibrate_port(void *arg)
+{
+	uint8_t portid = (uintptr_t)arg;
+
+	if (hwts_clock[portid].enabled) {
+		if (hwts_calibrate(portid, &hwts_clock[portid]))
+			RTE_LOG(INFO, DEMU, "  Port %u RX timestamp: %.3f TSC cycles per NIC tick\n",
+				(unsigned) portid, hwts_clock[portid].tsc_per_tick);
+		else {
+			RTE_LOG(WARNING, DEMU, "  Port %u cannot read the NIC clock, use TSC instead\n",
+				(unsigned) portid);
+			hwts_clock[portid].enabled = false;
+		}
+	}
+
+	if (txts_clock[portid].enabled) {
+		if (hwts_calibrate(portid, &txts_clock[portid]))
+			RTE_LOG(INFO, DEMU, "  Port %u TX pacing by NIC launch time\n", (unsigned) portid);
+		else
+			txts_clock[portid].enabled = false;
+	}
+
+	return 0;
+}
+#endif
+
+static int
+demu_init_ports(uint8_t nb_ports)
+{
+	uint8_t portid;
+#if DEMU_MBUF_DYN
+	unsigned lcore_id = demu_main_lcore();
+	unsigned port_lcore[RTE_MAX_ETHPORTS];
+#endif
+
+	for (portid = 0; portid < nb_ports; portid++)
+		if (demu_init_port(portid) < 0)
+			return -1;
+
+#if DEMU_MBUF_DYN
+	for (portid = 0; portid < nb_ports; portid++) {
+		if (lcore_id < RTE_MAX_LCORE)
+			lcore_id = rte_get_next_lcore(lcore_id, 1, 0);
+		port_lcore[portid] = lcore_id;
+		if (lcore_id < RTE_MAX_LCORE)
+			rte_eal_remote_launch(demu_calibrate_port, (void *)(uintptr_t)portid, lcore_id);
+	}
+
+	/* the ports left over are calibrated on the main lcore in the meantime */
+	for (portid = 0; portid < nb_ports; portid++)
+		if (port_lcore[portid] >= RTE_MAX_LCORE)
+			demu_calibrate_port((void *)(uintptr_t)portid);
+
+	for (portid = 0; portid < nb_ports; portid++)
+		if (port_lcore[portid] < RTE_MAX_LCORE)
+			rte_eal_wait_lcore(port_lcore[portid]);
+#endif
+
+	return 0;
+}
+
 static void
 check_all_ports_link_status(uint8_t port_num, uint32_t port_mask)
 {
-#define CHECK_INTERVAL 100 /* 100ms */
-#define MAX_CHECK_TIME 90 /* 9s (90 * 100ms) in total */
-	uint8_t portid, count, all_ports_up, print_flag = 0;
+	uint8_t portid, all_ports_up, print_flag = 0;
+	unsigned count, max_count = link_wait_ms / CHECK_INTERVAL;
 	struct rte_eth_link link;
 
 	RTE_LOG(INFO, DEMU, "Checking link status\n");
-	for (count = 0; count <= MAX_CHECK_TIME; count++) {
+	for (count = 0; count <= max_count + 1; count++) {
 		if (force_quit)
 			return;
 		all_ports_up = 1;
@@ -775,15 +4991,24 @@ check_all_ports_link_status(uint8_t port_num, uint32_t port_mask)
 		if (print_flag == 1)
 			break;
 
-		if (all_ports_up == 0)
-			rte_delay_ms(CHECK_INTERVAL);
-
 		/* set the print_flag if all ports up or timeout */
-		if (all_ports_up == 1 || count == (MAX_CHECK_TIME - 1))
+		if (all_ports_up == 1 || count == max_count)
 			print_flag = 1;
+		else
+			rte_delay_ms(CHECK_INTERVAL);
 	}
 }
 
+/* Time since t [ms] */
+static double
+demu_elapsed_ms(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
 static void
 signal_handler(int signum)
 {
@@ -801,125 +5026,252 @@ main(int argc, char **argv)
 	uint8_t nb_ports;
 	uint8_t portid;
 	unsigned lcore_id;
+	struct timespec startup;
+	double eal_ms, buffers_ms, ports_ms, ready_ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &startup);
 
 	/* init EAL */
 	ret = rte_eal_init(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "Invalid EAL arguments\n");
+	eal_ms = demu_elapsed_ms(&startup);
 	argc -= ret;
 	argv += ret;
 
+	rte_timer_subsystem_init();
+
+	/* statistics shared with demu-stat */
+	{
+		const struct rte_memzone *mz;
+
+		mz = rte_memzone_reserve(DEMU_STATS_MZ, sizeof(struct demu_stats),
+				rte_socket_id(), 0);
+		if (mz == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot reserve memzone for statistics: %s\n",
+				rte_strerror(rte_errno));
+		demu_stats = mz->addr;
+		memset(demu_stats, 0, sizeof(struct demu_stats));
+		demu_stats->tsc_hz = rte_get_tsc_hz();
+		port_statistics = demu_stats->port;
+#ifdef DEMU_PROFILE
+		demu_stats->profile = 1;
+		ring_sample_interval = rte_get_tsc_hz() / US_PER_S * DEMU_RING_SAMPLE_US;
+#endif
+	}
+
 	force_quit = false;
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 
 	/* parse application arguments (after the EAL ones) */
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		port_params[portid].nb_rxd = RTE_TEST_RX_DESC_DEFAULT;
+		port_params[portid].nb_txd = RTE_TEST_TX_DESC_DEFAULT;
+		port_params[portid].rx_burst = PKT_BURST_RX;
+		port_params[portid].tx_burst = PKT_BURST_TX;
+	}
+
 	ret = demu_parse_args(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "Invalid DEMU arguments\n");
 
-	/* create the mbuf pool */
-	demu_pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool",
-			DEMU_DELAYED_BUFFER_PKTS * 2 + DEMU_SEND_BUFFER_SIZE_PKTS * 2,
-			MEMPOOL_CACHE_SIZE, 0, MEMPOOL_BUF_SIZE,
-			rte_socket_id());
-
-	if (demu_pktmbuf_pool == NULL)
-		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool: %s\n", rte_strerror(rte_errno));
-
-	#if DPDK_VERSION > 17
-		nb_ports = rte_eth_dev_count_avail();
-	#else
-		nb_ports = rte_eth_dev_count();
-	#endif
-
-	if (nb_ports == 0)
-		rte_exit(EXIT_FAILURE, "No Ethernet ports - bye\n");
-
-	if (nb_ports > RTE_MAX_ETHPORTS)
-		nb_ports = RTE_MAX_ETHPORTS;
+	demu_stats->probe_interval = latency_probe;
+	demu_stats->latency[1].target_us = delayed_time_in_us;
 
-	/* Initialise each port */
-	for (portid = 0; portid < nb_ports; portid++) {
-		/* init port */
-		RTE_LOG(INFO, DEMU, "Initializing port %u\n", (unsigned) portid);
-		ret = rte_eth_dev_configure(portid, 1, 1, &port_conf);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "Cannot configure device: err=%d, port=%u\n",
-					ret, (unsigned) portid);
+	demu_select_features();
 
-		rte_eth_macaddr_get(portid,&demu_ports_eth_addr[portid]);
+	if (!seed_given)
+		demu_seed = rte_rdtsc();
+	demu_rng_init(demu_seed);
+	RTE_LOG(INFO, DEMU, "Random seed: %" PRIu64 "\n", demu_seed);
+	if (decision_log_file && decision_log_alloc() < 0)
+		rte_exit(EXIT_FAILURE, "Cannot allocate decision log\n");
 
-		/* init one RX queue */
-		ret = rte_eth_rx_queue_setup(portid, 0, nb_rxd,
-				rte_eth_dev_socket_id(portid),
-				&rx_conf,
-				demu_pktmbuf_pool);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
-					ret, (unsigned) portid);
+	if (rtc_cores && rte_lcore_count() < rtc_cores)
+		rte_exit(EXIT_FAILURE, "Run-to-completion mode needs %u lcores\n", rtc_cores);
+#if DPDK_VERSION >= 21
+	if (rtc_cores) {
+		struct rte_cpu_intrinsics intrinsics;
 
-		/* init one TX queue on each port */
-		ret = rte_eth_tx_queue_setup(portid, 0, nb_txd,
-				rte_eth_dev_socket_id(portid),
-				&tx_conf);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup:err=%d, port=%u\n",
-					ret, (unsigned) portid);
+		rte_cpu_get_intrinsics_support(&intrinsics);
+		idle_umwait = intrinsics.power_pause;
+	}
+#endif
 
-		/* Start device */
-		ret = rte_eth_dev_start(portid);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_dev_start:err=%d, port=%u\n",
-					ret, (unsigned) portid);
+#if DEMU_MBUF_DYN
+	{
+		static const struct rte_mbuf_dynfield tsc_dynfield_desc = {
+			.name = "demu_dynfield_tsc",
+			.size = sizeof(uint64_t),
+			.align = __alignof__(uint64_t),
+		};
+
+		static const struct rte_mbuf_dynfield depart_dynfield_desc = {
+			.name = "demu_dynfield_depart",
+			.size = sizeof(uint64_t),
+			.align = __alignof__(uint64_t),
+		};
+
+		demu_tsc_dynfield_offset = rte_mbuf_dynfield_register(&tsc_dynfield_desc);
+		if (demu_tsc_dynfield_offset < 0)
+			rte_exit(EXIT_FAILURE, "Cannot register mbuf field: %s\n", rte_strerror(rte_errno));
+
+		demu_depart_dynfield_offset = rte_mbuf_dynfield_register(&depart_dynfield_desc);
+		if (demu_depart_dynfield_offset < 0)
+			rte_exit(EXIT_FAILURE, "Cannot register mbuf field: %s\n", rte_strerror(rte_errno));
+
+		if (tx_pacing && rte_mbuf_dyn_tx_timestamp_register(&txts_dynfield_offset,
+				&txts_dynflag) != 0)
+			txts_dynfield_offset = -1;
+
+		if (hw_timestamp && rte_mbuf_dyn_rx_timestamp_register(&hwts_dynfield_offset,
+				&hwts_dynflag_rx) != 0) {
+			RTE_LOG(WARNING, DEMU, "Cannot register RX timestamp field, use TSC instead\n");
+			hw_timestamp = false;
+		}
+	}
+#else
+	if (hw_timestamp) {
+		RTE_LOG(WARNING, DEMU, "NIC RX timestamps require DPDK 20.11 or later, use TSC instead\n");
+		hw_timestamp = false;
+	}
+#endif
 
-		rte_eth_promiscuous_enable(portid);
+	if (fq_enabled && fq_init(&flow_queue) < 0)
+		rte_exit(EXIT_FAILURE, "Cannot allocate flow queues\n");
 
-		RTE_LOG(INFO, DEMU, "  Port %u, MAC address: %02X:%02X:%02X:%02X:%02X:%02X\n",
-			(unsigned) portid,
-			demu_ports_eth_addr[portid].addr_bytes[0],
-			demu_ports_eth_addr[portid].addr_bytes[1],
-			demu_ports_eth_addr[portid].addr_bytes[2],
-			demu_ports_eth_addr[portid].addr_bytes[3],
-			demu_ports_eth_addr[portid].addr_bytes[4],
-			demu_ports_eth_addr[portid].addr_bytes[5]);
+	if (nb_vlan_link_rules && vlan_links_init(&vlan_links) < 0)
+		rte_exit(EXIT_FAILURE, "Cannot allocate VLAN links\n");
 
-		/* initialize port stats */
-		memset(&port_statistics, 0, sizeof(port_statistics));
+	/* packets from port 0 do not stay in mbufs with the byte arena */
+	if (arena_size) {
+		delay_arena.base = rte_malloc_socket("delay_arena", arena_size,
+				RTE_CACHE_LINE_SIZE, rte_socket_id());
+		if (delay_arena.base == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot allocate %lu bytes of arena\n", arena_size);
+		delay_arena.size = arena_size;
+		RTE_LOG(INFO, DEMU, "Delay arena of %lu MB\n", arena_size >> 20);
+	}
 
-	}	
+	/* create the mbuf pool, for one direction in the offline mode */
+	RTE_LOG(INFO, DEMU, "Buffering %u packets per direction\n", delayed_buffer_pkts);
+	demu_pktmbuf_pool = rte_pktmbuf_pool_create(DEMU_MBUF_POOL,
+			offline ? delayed_buffer_pkts + DEMU_SEND_BUFFER_SIZE_PKTS :
+			delayed_buffer_pkts * (arena_size ? 1 : 2) + DEMU_SEND_BUFFER_SIZE_PKTS * 2,
+			MEMPOOL_CACHE_SIZE, 0, MEMPOOL_BUF_SIZE,
+			rte_socket_id());
 
-	check_all_ports_link_status(nb_ports, demu_enabled_port_mask);
+	if (demu_pktmbuf_pool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool: %s\n", rte_strerror(rte_errno));
 
+	/* indirect mbufs for duplicated packets do not need a data room */
+	if (dup_rate) {
+		demu_clone_pool = rte_pktmbuf_pool_create(DEMU_CLONE_POOL,
+				DEMU_CLONE_POOL_PKTS, MEMPOOL_CACHE_SIZE, 0, 0,
+				rte_socket_id());
+		if (demu_clone_pool == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot init clone pool: %s\n", rte_strerror(rte_errno));
+	}
 
+	if (xt_enabled) {
+		demu_xt_pool = rte_pktmbuf_pool_create(DEMU_XT_POOL,
+				XT_POOL_PKTS, MEMPOOL_CACHE_SIZE, 0, MEMPOOL_BUF_SIZE,
+				rte_socket_id());
+		if (demu_xt_pool == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot init cross traffic pool: %s\n", rte_strerror(rte_errno));
+		if (xt_init(&cross_traffic) < 0)
+			rte_exit(EXIT_FAILURE, "Cannot init cross traffic\n");
+	}
 
-	rx_to_workers = rte_ring_create("rx_to_workers", DEMU_DELAYED_BUFFER_PKTS,
+	/* the packets from port 0 wait in the byte arena instead */
+	rx_to_workers = rte_ring_create(DEMU_RING_RX_TO_WORKERS,
+			arena_size ? DEMU_SEND_BUFFER_SIZE_PKTS : delayed_buffer_pkts,
 			rte_socket_id(),   RING_F_SP_ENQ | RING_F_SC_DEQ);
 	if (rx_to_workers == NULL)
 		rte_exit(EXIT_FAILURE, "%s\n", rte_strerror(rte_errno));
 
-	workers_to_tx = rte_ring_create("workers_to_tx", DEMU_SEND_BUFFER_SIZE_PKTS,
+	workers_to_tx = rte_ring_create(DEMU_RING_WORKERS_TO_TX, DEMU_SEND_BUFFER_SIZE_PKTS,
 			rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
 	if (workers_to_tx == NULL)
 		rte_exit(EXIT_FAILURE, "%s\n", rte_strerror(rte_errno));
 
-	rx_to_workers2 = rte_ring_create("rx_to_workers2", DEMU_DELAYED_BUFFER_PKTS,
+	rx_to_workers2 = rte_ring_create(DEMU_RING_RX_TO_WORKERS2, delayed_buffer_pkts,
 			rte_socket_id(),   RING_F_SP_ENQ | RING_F_SC_DEQ);
 
 	if (rx_to_workers2 == NULL)
 		rte_exit(EXIT_FAILURE, "%s\n", rte_strerror(rte_errno));
 
-	workers_to_tx2 = rte_ring_create("workers_to_tx2", DEMU_SEND_BUFFER_SIZE_PKTS,
+	workers_to_tx2 = rte_ring_create(DEMU_RING_WORKERS_TO_TX2, DEMU_SEND_BUFFER_SIZE_PKTS,
 			rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
 	if (workers_to_tx2 == NULL)
 		rte_exit(EXIT_FAILURE, "%s\n", rte_strerror(rte_errno));
+	buffers_ms = demu_elapsed_ms(&startup);
+
+	if (offline) {
+		demu_stats->nb_ports = 2;
+		ret = demu_offline_run();
+		if (decision_log_file)
+			decision_log_write(demu_stats->start_tsc);
+		RTE_LOG(INFO, DEMU, "Bye...\n");
+		return ret;
+	}
+
+	#if DPDK_VERSION > 17
+		nb_ports = rte_eth_dev_count_avail();
+	#else
+		nb_ports = rte_eth_dev_count();
+	#endif
+
+	if (nb_ports == 0)
+		rte_exit(EXIT_FAILURE, "No Ethernet ports - bye\n");
+
+	if (nb_ports > RTE_MAX_ETHPORTS)
+		nb_ports = RTE_MAX_ETHPORTS;
+
+	/* the fast path of unimpaired packets needs a second TX queue on port 1 */
+	if (nb_impair_rules) {
+		struct rte_eth_dev_info dev_info;
+
+		memset(&dev_info, 0, sizeof(dev_info));
+		if (nb_ports < 2)
+			rte_exit(EXIT_FAILURE, "Selective impairment needs two ports\n");
+		rte_eth_dev_info_get(1, &dev_info);
+		if (dev_info.max_tx_queues < 2)
+			rte_exit(EXIT_FAILURE, "Selective impairment needs two TX queues on port 1"
+				" (e.g., qpairs=2 for af_packet)\n");
+		memset(&dev_info, 0, sizeof(dev_info));
+		rte_eth_dev_info_get(0, &dev_info);
+		steer_hw = dev_info.max_rx_queues >= 2;
+	}
+
+	if (demu_init_ports(nb_ports) < 0)
+		rte_exit(EXIT_FAILURE, "Cannot initialize ports\n");
+	ports_ms = demu_elapsed_ms(&startup);
+
+	check_all_ports_link_status(nb_ports, demu_enabled_port_mask);
+
+	/* the time to forwarding, to be tracked across restarts */
+	ready_ms = demu_elapsed_ms(&startup);
+	RTE_LOG(INFO, DEMU, "Startup: ready to forward in %.1f ms (EAL %.1f, buffers %.1f,"
+		" ports %.1f, links %.1f)\n", ready_ms, eal_ms, buffers_ms - eal_ms,
+		ports_ms - buffers_ms, ready_ms - ports_ms);
 
+	demu_stats->nb_ports = nb_ports;
 
+	demu_stats->start_tsc = rte_rdtsc();
+	if (slot_enabled)
+		slot_start(&slots, demu_stats->start_tsc);
 
 	ret = 0;
 	/* launch per-lcore init on every lcore */
+#if DPDK_VERSION >= 21
+	rte_eal_mp_remote_launch(demu_launch_one_lcore, NULL, CALL_MAIN);
+	RTE_LCORE_FOREACH_WORKER(lcore_id) {
+#else
 	rte_eal_mp_remote_launch(demu_launch_one_lcore, NULL, CALL_MASTER);
 	RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+#endif
 		if (rte_eal_wait_lcore(lcore_id) < 0) {
 			ret = -1;
 			break;
@@ -934,6 +5286,49 @@ main(int argc, char **argv)
 		rte_eth_stats_get(portid, &stats);
 		RTE_LOG(INFO, DEMU, "port %d: in pkt: %ld out pkt: %ld in missed: %ld in errors: %ld out errors: %ld\n",
 			portid, stats.ipackets, stats.opackets, stats.imissed, stats.ierrors, stats.oerrors);
+		RTE_LOG(INFO, DEMU, "port %d: discarded: %lu duplicated: %lu dup dropped: %lu\n",
+			portid, port_statistics[portid].discarded,
+			port_statistics[portid].duplicated, port_statistics[portid].dup_dropped);
+		RTE_LOG(INFO, DEMU, "port %d: dropped: rx to worker: %lu fast path: %lu"
+			" worker to tx: %lu flow queue: %lu tx: %lu\n",
+			portid, port_statistics[portid].rx_worker_dropped,
+			port_statistics[portid].fastpath_dropped,
+			port_statistics[portid].worker_tx_dropped,
+			port_statistics[portid].queue_dropped, port_statistics[portid].dropped);
+		if (portid == 0) {
+			unsigned n;
+
+			if (xt_enabled)
+				RTE_LOG(INFO, DEMU, "cross traffic: generated: %lu dropped: %lu\n",
+					port_statistics[0].xt_generated, port_statistics[0].xt_dropped);
+
+			for (n = 0; n < nb_hops; n++)
+				RTE_LOG(INFO, DEMU, "hop %u: lost: %lu dropped: %lu\n",
+					n, hops[n].lost, hops[n].dropped);
+
+			if (slot_enabled)
+				RTE_LOG(INFO, DEMU, "slots: aggregates: %lu\n", slots.aggregates);
+
+			for (n = 0; n < vlan_links.nb_links; n++) {
+				const struct demu_vlan_link_stats *ls = &vlan_links.stats[n];
+
+				if (ls->pkts)
+					RTE_LOG(INFO, DEMU, "vlan %u: pkts: %lu lost: %lu dropped: %lu\n",
+						ls->vid, ls->pkts, ls->lost, ls->dropped);
+			}
+		}
+		if (latency_probe && portid < DEMU_LATENCY_PORTS) {
+			const struct demu_latency_hist *h = &demu_stats->latency[portid];
+			double us_per_tsc = (double)US_PER_S / rte_get_tsc_hz();
+
+			RTE_LOG(INFO, DEMU, "port %d: residence time [us]: samples: %lu target: %lu"
+				" p50: %.1f p99: %.1f p99.9: %.1f max: %.1f\n",
+				portid, h->count, h->target_us,
+				demu_hist_quantile(h, 0.5) * us_per_tsc,
+				demu_hist_quantile(h, 0.99) * us_per_tsc,
+				demu_hist_quantile(h, 0.999) * us_per_tsc,
+				h->max * us_per_tsc);
+		}
 		rte_eth_dev_stop(portid);
 		rte_eth_dev_close(portid);
 	}
@@ -975,6 +5370,34 @@ main(int argc, char **argv)
 #endif
 
 
+#ifdef DEMU_PROFILE
+	RTE_LCORE_FOREACH(lcore_id) {
+		const struct demu_lcore_profile *lp = &demu_stats->lcore[lcore_id];
+		unsigned stage;
+
+		for (stage = 0; stage < DEMU_NB_STAGES; stage++) {
+			const struct demu_stage_profile *p = &lp->stage[stage];
+			uint64_t cycles = p->cycles;
+
+			/* the RX stage includes the impairment, as in demu-stat */
+			if (stage == DEMU_STAGE_RX)
+				cycles -= lp->stage[DEMU_STAGE_IMPAIR].cycles;
+			if (p->calls == 0)
+				continue;
+			RTE_LOG(INFO, DEMU, "lcore %u %s: calls: %lu empty: %.1f%% packets: %lu"
+				" cycles/packet: %.1f\n", lcore_id, demu_stage_name(stage), p->calls,
+				100.0 * p->empty / p->calls, p->pkts,
+				p->pkts ? (double)cycles / p->pkts : 0);
+		}
+	}
+#endif
+
+	if (scenario_file)
+		scenario_write_log();
+
+	if (decision_log_file)
+		decision_log_write(demu_stats->start_tsc);
+
 	/* rte_ring_dump(stdout, rx_to_workers); */
 	/* rte_ring_dump(stdout, workers_to_tx); */
 
@@ -1046,7 +5469,7 @@ loss_event_random(uint64_t loss_rate)
 	bool flag = false;
 	uint64_t temp;
 
-	temp = rte_rand() % (RANDOM_MAX + 1);
+	temp = demu_rand() % (RANDOM_MAX + 1);
 	if (loss_rate >= temp)
 		flag = true;
 
@@ -1076,12 +5499,12 @@ loss_event_GE(uint64_t loss_rate_n, uint64_t loss_rate_a, uint64_t st_ch_rate_no
 		state_ch_rate = st_ch_rate_ab2no;
 	}
 
-	rnd_loss = rte_rand() % (RANDOM_MAX + 1);
+	rnd_loss = demu_rand() % (RANDOM_MAX + 1);
 	if (rnd_loss < loss_rate) {
 		flag = true;
 	}
 
-	rnd_tran = rte_rand() % (RANDOM_MAX + 1);
+	rnd_tran = demu_rand() % (RANDOM_MAX + 1);
 	if (rnd_tran < state_ch_rate) {
 		state = !state;
 	}
@@ -1103,7 +5526,7 @@ loss_event_4state( uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint6
 {
 	static char state = 1; 
 	bool flag = false;
-	uint64_t rnd = rte_rand() % (RANDOM_MAX + 1);
+	uint64_t rnd = demu_rand() % (RANDOM_MAX + 1);
 
 	switch (state) {
 	case 1:
@@ -1140,33 +5563,57 @@ loss_event_4state( uint64_t p13, uint64_t p14, uint64_t p23, uint64_t p31, uint6
 	return flag;
 }
 
-static bool
+/* Return the number of copies to be made of a packet */
+static unsigned
 dup_event(void)
 {
-	if (unlikely(loss_event_random(dup_rate) == true))
-		return true;
-	else
-		return false;
+	unsigned n;
+
+	if (likely(loss_event_random(dup_rate) == false))
+		return 0;
+
+	switch (dup_dist) {
+	case DUP_DIST_UNIFORM:
+		n = 1 + demu_rand() % dup_copies;
+		break;
+
+	case DUP_DIST_GEOMETRIC:
+		n = 1;
+		while (n < dup_copies && loss_event_random(dup_rate) == true)
+			n++;
+		break;
+
+	case DUP_DIST_FIXED:
+	default:
+		n = dup_copies;
+		break;
+	}
+
+	return n;
 }
 
+/* Marsaglia polar method, clipped at 0 */
 static uint64_t normal_distribution(uint64_t mean, uint64_t stddev)
 {
-    static double spare;
-    static int has_spare = 0;
+    struct demu_rng *r = &demu_rngs[rte_lcore_id()];
+    double z;
 
-    if (has_spare) {
-        has_spare = 0;
-        return spare * stddev + mean;
+    if (r->has_spare) {
+        r->has_spare = false;
+        z = r->spare;
     } else {
         double u, v, s;
         do {
-            u = (rand() / ((double)RAND_MAX)) * 2.0 - 1.0;
-            v = (rand() / ((double)RAND_MAX)) * 2.0 - 1.0;
+            u = demu_rand_double() * 2.0 - 1.0;
+            v = demu_rand_double() * 2.0 - 1.0;
             s = u * u + v * v;
         } while (s >= 1.0 || s == 0.0);
         s = sqrt(-2.0 * log(s) / s);
-        spare = v * s;
-        has_spare = 1;
-        return mean + stddev * u * s;
+        r->spare = v * s;
+        r->has_spare = true;
+        z = u * s;
     }
+
+    z = mean + stddev * z;
+    return z > 0 ? (uint64_t)z : 0;
 }
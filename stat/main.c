@@ -0,0 +1,375 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2016 Intel Corporation. All rights reserved.
+ *   Copyright(c) 2016-2021 National Institute of Advanced Industrial
+ *                Science and Technology. All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* vim: set noexpandtab ai: */
+
+/*
+ * demu-stat: a DPDK secondary process which attaches to a running DEMU and
+ * periodically shows the per-port counters, the occupancy of the rings
+ * between the pipeline stages, the usage of the mempools, the residence
+ * time measured by the latency probe of DEMU, and the cycles spent in each
+ * stage if DEMU is built with DEMU_PROFILE.
+ *
+ *   demu-stat [EAL options] --proc-type=secondary -- [-i interval [ms]] [-b] [-c count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+
+#include <rte_common.h>
+#include <rte_log.h>
+#include <rte_memory.h>
+#include <rte_memzone.h>
+#include <rte_eal.h>
+#include <rte_cycles.h>
+#include <rte_ring.h>
+#include <rte_mempool.h>
+#include <rte_errno.h>
+
+#include "../demu_stats.h"
+
+#define RTE_LOGTYPE_DEMU RTE_LOGTYPE_USER1
+
+static volatile bool force_quit;
+
+static unsigned interval_ms = 100;
+static bool batch_mode = false;
+static uint64_t sample_count = 0;
+
+/* in the order of enum demu_ring_index */
+static const char * const ring_names[DEMU_NB_RINGS] = {
+	DEMU_RING_RX_TO_WORKERS,
+	DEMU_RING_WORKERS_TO_TX2,
+	DEMU_RING_RX_TO_WORKERS2,
+	DEMU_RING_WORKERS_TO_TX,
+};
+
+/* display usage */
+static void
+demu_stat_usage(const char *prgname)
+{
+	printf("%s [EAL options] --proc-type=secondary -- [-i interval [ms]] [-b] [-c count]\n"
+		" -i update interval [ms] (default is 100ms)\n"
+		" -b batch mode: print one CSV line per sample\n"
+		" -c number of samples (default is 0, unlimited)\n",
+		prgname);
+}
+
+static int
+demu_stat_parse_args(int argc, char **argv)
+{
+	int opt;
+	char *end;
+	char *prgname = argv[0];
+	long n;
+
+	while ((opt = getopt(argc, argv, "bc:i:")) != EOF) {
+		switch (opt) {
+			case 'b':
+				batch_mode = true;
+				break;
+
+			case 'c':
+			case 'i':
+				n = strtol(optarg, &end, 10);
+				if (optarg[0] == '\0' || *end != '\0' || n < 0 ||
+						(opt == 'i' && n == 0)) {
+					demu_stat_usage(prgname);
+					return -1;
+				}
+				if (opt == 'c')
+					sample_count = n;
+				else
+					interval_ms = n;
+				break;
+
+			default:
+				demu_stat_usage(prgname);
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+signal_handler(int signum)
+{
+	if (signum == SIGINT || signum == SIGTERM)
+		force_quit = true;
+}
+
+static void
+print_header(const struct demu_stats *stats)
+{
+	unsigned portid, i;
+
+	printf("time");
+	for (portid = 0; portid < stats->nb_ports; portid++)
+		printf(",port%u_rx,port%u_tx,port%u_discarded,port%u_dropped",
+			portid, portid, portid, portid);
+	for (i = 0; i < DEMU_NB_RINGS; i++)
+		printf(",%s", ring_names[i]);
+	printf(",%s_in_use,%s_in_use", DEMU_MBUF_POOL, DEMU_CLONE_POOL);
+	if (stats->probe_interval)
+		for (portid = 0; portid < DEMU_LATENCY_PORTS; portid++)
+			printf(",port%u_p50_us,port%u_p99_us,port%u_p999_us,port%u_max_us",
+				portid, portid, portid, portid);
+	printf("\n");
+}
+
+static const double latency_quantiles[] = { 0.5, 0.99, 0.999 };
+
+/* Quantiles and the maximum of the residence time in microseconds */
+static void
+latency_summary(const struct demu_stats *stats, unsigned portid, double *us)
+{
+	const struct demu_latency_hist *h = &stats->latency[portid];
+	double us_per_tsc = 1e6 / stats->tsc_hz;
+	unsigned i;
+
+	for (i = 0; i < RTE_DIM(latency_quantiles); i++)
+		us[i] = demu_hist_quantile(h, latency_quantiles[i]) * us_per_tsc;
+	us[i] = h->max * us_per_tsc;
+}
+
+/* Cycles, empty polls and ring occupancy since the previous sample */
+static void
+print_profile(const struct demu_stats *stats, struct demu_lcore_profile *prev_lcore,
+		struct demu_ring_profile *prev_ring, double sec)
+{
+	unsigned lcore_id, stage, i;
+
+	printf("\n%-6s %-8s %12s %8s %12s %12s %8s\n", "lcore", "stage",
+		"calls/s", "empty", "pkts/s", "cycles/pkt", "busy");
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		struct demu_lcore_profile cur = stats->lcore[lcore_id];
+
+		for (stage = 0; stage < DEMU_NB_STAGES; stage++) {
+			const struct demu_stage_profile *p = &cur.stage[stage];
+			const struct demu_stage_profile *q = &prev_lcore[lcore_id].stage[stage];
+			uint64_t calls = p->calls - q->calls, pkts = p->pkts - q->pkts;
+			uint64_t cycles = p->cycles - q->cycles;
+
+			/* the RX stage includes the impairment */
+			if (stage == DEMU_STAGE_RX)
+				cycles -= cur.stage[DEMU_STAGE_IMPAIR].cycles -
+					prev_lcore[lcore_id].stage[DEMU_STAGE_IMPAIR].cycles;
+			if (calls == 0)
+				continue;
+			printf("%-6u %-8s %12.0f %7.1f%% %12.0f %12.1f %7.1f%%\n", lcore_id,
+				demu_stage_name(stage), calls / sec,
+				100.0 * (p->empty - q->empty) / calls, pkts / sec,
+				pkts ? (double)cycles / pkts : 0,
+				100.0 * cycles / (sec * stats->tsc_hz));
+		}
+		prev_lcore[lcore_id] = cur;
+	}
+
+	printf("\n%-16s %12s %12s\n", "ring", "average", "max");
+	for (i = 0; i < DEMU_NB_RINGS; i++) {
+		struct demu_ring_profile cur = stats->ring[i];
+		uint64_t samples = cur.samples - prev_ring[i].samples;
+
+		if (cur.samples == 0)
+			continue;
+		printf("%-16s %12.1f %12u\n", ring_names[i],
+			samples ? (double)(cur.sum - prev_ring[i].sum) / samples : cur.last, cur.max);
+		prev_ring[i] = cur;
+	}
+}
+
+static uint64_t
+port_dropped(const struct demu_port_statistics *s)
+{
+	return s->rx_worker_dropped + s->dup_dropped + s->fastpath_dropped + s->worker_tx_dropped +
+		s->queue_dropped + s->dropped;
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct rte_memzone *mz;
+	const struct demu_stats *stats;
+	struct demu_port_statistics prev[RTE_MAX_ETHPORTS], cur;
+	static struct demu_lcore_profile prev_lcore[RTE_MAX_LCORE];
+	static struct demu_ring_profile prev_ring[DEMU_NB_RINGS];
+	struct rte_ring *rings[DEMU_NB_RINGS] = { NULL };
+	struct rte_mempool *mbuf_pool = NULL, *clone_pool = NULL, *xt_pool = NULL;
+	uint64_t prev_tsc, now, n;
+	double sec, elapsed, lat[RTE_DIM(latency_quantiles) + 1];
+	unsigned portid, i;
+	int ret;
+
+	ret = rte_eal_init(argc, argv);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "Invalid EAL arguments\n");
+	argc -= ret;
+	argv += ret;
+
+	if (rte_eal_process_type() != RTE_PROC_SECONDARY)
+		rte_exit(EXIT_FAILURE, "demu-stat must run with --proc-type=secondary\n");
+
+	if (demu_stat_parse_args(argc, argv) < 0)
+		rte_exit(EXIT_FAILURE, "Invalid demu-stat arguments\n");
+
+	force_quit = false;
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	mz = rte_memzone_lookup(DEMU_STATS_MZ);
+	if (mz == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot find %s, is DEMU running?\n", DEMU_STATS_MZ);
+	stats = mz->addr;
+
+	memcpy(prev, stats->port, sizeof(prev));
+	memcpy(prev_lcore, stats->lcore, sizeof(prev_lcore));
+	memcpy(prev_ring, stats->ring, sizeof(prev_ring));
+	prev_tsc = rte_rdtsc();
+
+	if (batch_mode)
+		print_header(stats);
+
+	for (n = 0; !force_quit && (sample_count == 0 || n < sample_count); n++) {
+		usleep(interval_ms * 1000);
+
+		now = rte_rdtsc();
+		sec = (double)(now - prev_tsc) / stats->tsc_hz;
+		elapsed = stats->start_tsc ? (double)(now - stats->start_tsc) / stats->tsc_hz : 0;
+		prev_tsc = now;
+
+		/* DEMU creates the rings and the pools after the statistics */
+		for (i = 0; i < DEMU_NB_RINGS; i++)
+			if (rings[i] == NULL)
+				rings[i] = rte_ring_lookup(ring_names[i]);
+		if (mbuf_pool == NULL)
+			mbuf_pool = rte_mempool_lookup(DEMU_MBUF_POOL);
+		if (clone_pool == NULL)
+			clone_pool = rte_mempool_lookup(DEMU_CLONE_POOL);
+		if (xt_pool == NULL)
+			xt_pool = rte_mempool_lookup(DEMU_XT_POOL);
+
+		if (batch_mode) {
+			printf("%.6f", elapsed);
+			for (portid = 0; portid < stats->nb_ports; portid++) {
+				cur = stats->port[portid];
+				printf(",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+					cur.rx, cur.tx, cur.discarded + cur.hop_lost + cur.link_lost, port_dropped(&cur));
+			}
+			for (i = 0; i < DEMU_NB_RINGS; i++)
+				printf(",%u", rings[i] ? rte_ring_count(rings[i]) : 0);
+			printf(",%u,%u",
+				mbuf_pool ? rte_mempool_in_use_count(mbuf_pool) : 0,
+				clone_pool ? rte_mempool_in_use_count(clone_pool) : 0);
+			if (stats->probe_interval) {
+				for (portid = 0; portid < DEMU_LATENCY_PORTS; portid++) {
+					latency_summary(stats, portid, lat);
+					printf(",%.1f,%.1f,%.1f,%.1f", lat[0], lat[1], lat[2], lat[3]);
+				}
+			}
+			printf("\n");
+			fflush(stdout);
+			continue;
+		}
+
+		/* clear the screen and move the cursor to the top */
+		printf("\033[2J\033[H");
+		printf("DEMU pipeline statistics: %.1f s elapsed, every %u ms\n\n",
+			elapsed, interval_ms);
+
+		printf("%-6s %12s %12s %14s %14s %12s %12s %12s\n", "port",
+			"rx pps", "tx pps", "rx", "tx", "discarded", "duplicated", "dropped");
+		for (portid = 0; portid < stats->nb_ports; portid++) {
+			cur = stats->port[portid];
+			printf("%-6u %12.0f %12.0f %14" PRIu64 " %14" PRIu64 " %12" PRIu64
+				" %12" PRIu64 " %12" PRIu64 "\n", portid,
+				(cur.rx - prev[portid].rx) / sec, (cur.tx - prev[portid].tx) / sec,
+				cur.rx, cur.tx, cur.discarded + cur.hop_lost + cur.link_lost, cur.duplicated, port_dropped(&cur));
+			prev[portid] = cur;
+		}
+
+		printf("\n%-16s %12s %12s %8s\n", "ring", "count", "capacity", "usage");
+		for (i = 0; i < DEMU_NB_RINGS; i++) {
+			unsigned count, capacity;
+
+			if (rings[i] == NULL)
+				continue;
+			count = rte_ring_count(rings[i]);
+			capacity = rte_ring_get_capacity(rings[i]);
+			printf("%-16s %12u %12u %7.1f%%\n", ring_names[i], count, capacity,
+				100.0 * count / capacity);
+		}
+
+		printf("\n%-16s %12s %12s\n", "mempool", "in use", "available");
+		if (mbuf_pool != NULL)
+			printf("%-16s %12u %12u\n", DEMU_MBUF_POOL,
+				rte_mempool_in_use_count(mbuf_pool), rte_mempool_avail_count(mbuf_pool));
+		if (clone_pool != NULL)
+			printf("%-16s %12u %12u\n", DEMU_CLONE_POOL,
+				rte_mempool_in_use_count(clone_pool), rte_mempool_avail_count(clone_pool));
+		if (xt_pool != NULL)
+			printf("%-16s %12u %12u\n", DEMU_XT_POOL,
+				rte_mempool_in_use_count(xt_pool), rte_mempool_avail_count(xt_pool));
+
+		/* error of the residence time against the configured delay */
+		if (stats->probe_interval) {
+			printf("\n%-6s %12s %10s %10s %10s %10s %10s  (error [us], 1 in %u)\n",
+				"egress", "samples", "target", "p50", "p99", "p99.9", "max",
+				stats->probe_interval);
+			for (portid = 0; portid < DEMU_LATENCY_PORTS; portid++) {
+				const struct demu_latency_hist *h = &stats->latency[portid];
+				double target = h->target_us;
+
+				if (h->count == 0)
+					continue;
+				latency_summary(stats, portid, lat);
+				printf("%-6u %12" PRIu64 " %10.0f %+10.1f %+10.1f %+10.1f %+10.1f\n",
+					portid, h->count, target, lat[0] - target, lat[1] - target,
+					lat[2] - target, lat[3] - target);
+			}
+		}
+
+		if (stats->profile)
+			print_profile(stats, prev_lcore, prev_ring, sec);
+		fflush(stdout);
+	}
+
+	return 0;
+}